@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "ChunkStreamer.hpp"
+
+
+ChunkStreamer::~ChunkStreamer()
+{
+    stop();
+}
+
+void ChunkStreamer::start(GridCell* grid, int gridWidth, int gridHeight, int maxResidentChunks)
+{
+    stop();
+    mesher.init(grid, gridWidth, gridHeight);
+    maxResident = maxResidentChunks;
+    resident.assign(chunkCount(), false);
+    residentVersions.assign(chunkCount(), 0);
+    residentChunks.clear();
+    queued.assign(chunkCount(), false);
+    queuedNew = 0;
+    versions.assign(chunkCount(), 0);
+    requests.clear();
+    loaded.clear();
+    quit = false;
+    loader = std::thread(&ChunkStreamer::run, this);
+}
+
+void ChunkStreamer::stop()
+{
+    if (!loader.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeUp.notify_all();
+    loader.join();
+}
+
+void ChunkStreamer::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wakeUp.wait(lock, [&] { return quit || !requests.empty(); });
+        if (quit) return;
+        int chunk = requests.back();
+        requests.pop_back();
+        // the grid only changes under the lock, so the chunk is meshed while holding it; a chunk
+        // takes microseconds
+        LoadedChunk loadedChunk;
+        loadedChunk.version = versions[chunk];
+        mesher.mesh(chunk, loadedChunk.mesh);
+        loaded.push_back(std::move(loadedChunk));
+    }
+}
+
+void ChunkStreamer::setCell(int row, int col, GridCell type)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    changedChunks.clear();
+    mesher.setCell(row, col, type, changedChunks);
+    for (int chunk : changedChunks) {
+        versions[chunk]++;
+    }
+}
+
+void ChunkStreamer::update(int row, int col, int radius, std::vector<int>& evicted)
+{
+    evicted.clear();
+    int columns = mesher.chunkColumnCount();
+    int centerRow = std::min(std::max(row / MazeMesher::chunkSize, 0), mesher.chunkRowCount() - 1);
+    int centerCol = std::min(std::max(col / MazeMesher::chunkSize, 0), columns - 1);
+    auto distance = [&](int chunk) {
+        return std::max(std::abs(chunk / columns - centerRow), std::abs(chunk % columns - centerCol));
+    };
+
+    // chunks in the radius that are missing or outdated, nearest first
+    wanted.clear();
+    for (int r = std::max(centerRow - radius, 0); r <= std::min(centerRow + radius, mesher.chunkRowCount() - 1); r++) {
+        for (int c = std::max(centerCol - radius, 0); c <= std::min(centerCol + radius, columns - 1); c++) {
+            int chunk = r * columns + c;
+            if (!queued[chunk] && (!resident[chunk] || residentVersions[chunk] != versions[chunk])) {
+                wanted.push_back(chunk);
+            }
+        }
+    }
+    std::sort(wanted.begin(), wanted.end(), [&](int a, int b) { return distance(a) < distance(b); });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // requests that left the radius before the loader got to them are dropped
+    requests.erase(std::remove_if(requests.begin(), requests.end(), [&](int chunk) {
+        if (distance(chunk) <= radius) return false;
+        queued[chunk] = false;
+        if (!resident[chunk]) {
+            queuedNew--;
+        }
+        return true;
+    }), requests.end());
+
+    // new chunks make room by evicting the farthest resident chunks outside the radius; chunks
+    // that are being remeshed stay
+    std::sort(residentChunks.begin(), residentChunks.end(), [&](int a, int b) { return distance(a) > distance(b); });
+    size_t candidate = 0;
+    int residentCount = residentChunks.size();
+    for (int chunk : wanted) {
+        if (!resident[chunk]) {
+            while (residentCount + queuedNew >= maxResident && candidate < residentChunks.size()
+                    && distance(residentChunks[candidate]) > radius) {
+                int farthest = residentChunks[candidate++];
+                if (queued[farthest]) continue;
+                resident[farthest] = false;
+                residentCount--;
+                evicted.push_back(farthest);
+            }
+            // the remaining chunks are farther away than the ones that fit
+            if (residentCount + queuedNew >= maxResident) break;
+            queuedNew++;
+        }
+        queued[chunk] = true;
+        requests.push_back(chunk);
+    }
+    residentChunks.erase(std::remove_if(residentChunks.begin(), residentChunks.end(),
+            [&](int chunk) { return !resident[chunk]; }), residentChunks.end());
+
+    std::sort(requests.begin(), requests.end(), [&](int a, int b) { return distance(a) > distance(b); });
+    if (!requests.empty()) {
+        wakeUp.notify_one();
+    }
+}
+
+void ChunkStreamer::takeLoaded(std::vector<ChunkMesh>& meshes)
+{
+    meshes.clear();
+    std::vector<LoadedChunk> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.swap(loaded);
+    }
+    for (LoadedChunk& loadedChunk : finished) {
+        int chunk = loadedChunk.mesh.chunk;
+        queued[chunk] = false;
+        if (!resident[chunk]) {
+            queuedNew--;
+            resident[chunk] = true;
+            residentChunks.push_back(chunk);
+        }
+        // a chunk that changed while it was meshed is requested again by the next update
+        residentVersions[chunk] = loadedChunk.version;
+        meshes.push_back(std::move(loadedChunk.mesh));
+    }
+}
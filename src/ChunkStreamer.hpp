@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "MazeMesher.hpp"
+
+// Keeps the chunk meshes around the player resident. Chunks within a radius of the player's
+// chunk are meshed on a loader thread, nearest first, and chunks outside the radius are evicted,
+// farthest first, when more than a fixed number would be resident. The caller owns the GPU
+// side: it uploads the meshes handed out by takeLoaded and frees the chunks evicted by update.
+class ChunkStreamer
+{
+private:
+    struct LoadedChunk
+    {
+        unsigned int version;   // of the chunk when it was meshed
+        ChunkMesh mesh;
+    };
+
+    MazeMesher mesher;
+    int maxResident = 0;
+    // main thread state
+    std::vector<bool> resident;
+    std::vector<unsigned int> residentVersions;
+    std::vector<int> residentChunks;
+    std::vector<bool> queued;           // requested and not handed out yet
+    int queuedNew = 0;                  // queued chunks that are not resident yet
+    std::vector<int> changedChunks;
+    std::vector<int> wanted;
+    // shared with the loader thread
+    std::mutex mutex;                   // also guards the grid of the mesher
+    std::condition_variable wakeUp;
+    std::vector<unsigned int> versions; // counts the changes of each chunk; written by the main thread only
+    std::vector<int> requests;          // nearest last
+    std::vector<LoadedChunk> loaded;
+    bool quit = false;
+    std::thread loader;
+
+    void run();
+public:
+    ~ChunkStreamer();
+
+    // Starts the loader; at most maxResidentChunks chunks are resident or being loaded at a time.
+    // The loader reads the grid in place, so it must outlive the streamer and change only
+    // through setCell.
+    void start(GridCell* grid, int gridWidth, int gridHeight, int maxResidentChunks);
+    void stop();
+
+    void setCell(int row, int col, GridCell type);
+    // Requests the chunks within radius chunks around the cell, including resident ones that
+    // changed since they were meshed, and hands the chunks evicted to make room to the caller.
+    void update(int row, int col, int radius, std::vector<int>& evicted);
+    // hands the meshes finished since the last call to the caller
+    void takeLoaded(std::vector<ChunkMesh>& meshes);
+
+    int chunkCount() const { return mesher.chunkCount(); }
+    int chunkOf(int row, int col) const { return mesher.chunkOf(row, col); }
+};
@@ -0,0 +1,341 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// Runs compute-shader-cull.glsl in a headless OpenGL 4.5 core context, e.g. on Mesa llvmpipe,
+// over a few cells and a known depth pyramid, and checks the draw commands and visible cells it
+// writes. The buffers are set up like GpuCulling::init and GpuCulling::cull do.
+// Usage: gpu-culling-test compute-shader-cull.glsl
+
+namespace {
+
+enum CellType : GLuint { EMPTY = 0, WALL = 1, COIN = 4, DOOR = 5 };
+
+// laid out like Cell in compute-shader-cull.glsl, see CellData
+struct Cell
+{
+    float position[2];
+    GLuint type;
+    GLuint pad;
+};
+
+struct Command
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+constexpr int meshCount = 3;        // wall, floor and coin
+constexpr int pyramidSize = 64;     // width and height of level 0
+constexpr int pyramidLevels = 7;
+
+// column-major 4x4 matrices, as uploaded by QOpenGLShaderProgram
+struct Matrix
+{
+    float m[16];
+
+    float at(int row, int col) const { return m[4 * col + row]; }
+};
+
+Matrix multiply(const Matrix& a, const Matrix& b)
+{
+    Matrix r;
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            float sum = 0.0f;
+            for (int k = 0; k < 4; k++) {
+                sum += a.at(row, k) * b.at(k, col);
+            }
+            r.m[4 * col + row] = sum;
+        }
+    }
+    return r;
+}
+
+// like QMatrix4x4::perspective with a square aspect
+Matrix perspective(float fovY, float nearPlane, float farPlane)
+{
+    float f = 1.0f / std::tan(fovY / 2.0f * float(M_PI) / 180.0f);
+    Matrix r = {};
+    r.m[0] = f;
+    r.m[5] = f;
+    r.m[10] = -(farPlane + nearPlane) / (farPlane - nearPlane);
+    r.m[11] = -1.0f;
+    r.m[14] = -2.0f * farPlane * nearPlane / (farPlane - nearPlane);
+    return r;
+}
+
+// a camera at the given position that looks along -z
+Matrix translation(float x, float y, float z)
+{
+    Matrix r = {};
+    r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1.0f;
+    r.m[12] = -x;
+    r.m[13] = -y;
+    r.m[14] = -z;
+    return r;
+}
+
+// window depth of a world point, as stored in level 0 of a depth pyramid
+float windowDepth(const Matrix& clip, float x, float y, float z)
+{
+    float p[4] = { x, y, z, 1.0f };
+    float c[4];
+    for (int row = 0; row < 4; row++) {
+        c[row] = clip.at(row, 0) * p[0] + clip.at(row, 1) * p[1] + clip.at(row, 2) * p[2] + clip.at(row, 3) * p[3];
+    }
+    return c[2] / c[3] * 0.5f + 0.5f;
+}
+
+// see frustumPlanes in KdTree.cpp
+void frustumPlanes(const Matrix& clip, float* planes)
+{
+    for (int i = 0; i < 6; i++) {
+        int axis = i / 2;
+        float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        for (int col = 0; col < 4; col++) {
+            planes[4 * i + col] = clip.at(3, col) + sign * clip.at(axis, col);
+        }
+    }
+}
+
+bool readFile(const char* fileName, std::string& text)
+{
+    std::ifstream file(fileName);
+    if (!file) return false;
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    text = buffer.str();
+    return true;
+}
+
+bool createContext()
+{
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    EGLDisplay display = getPlatformDisplay
+        ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr)
+        : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    const EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 5,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+GLuint compileCullProgram(const std::string& source)
+{
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    const char* text = source.c_str();
+    glShaderSource(shader, 1, &text, nullptr);
+    glCompileShader(shader);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[4096];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "Could not link culling program:" << std::endl << log << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Level 0 holds the depth of a plane at z = -10 in its left half and the far plane in its right
+// half; every further level keeps the maximum of the texels below it, like DepthPyramid::build.
+GLuint createPyramid(const Matrix& clip)
+{
+    GLuint texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, pyramidLevels, GL_R32F, pyramidSize, pyramidSize);
+    glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    float wallDepth = windowDepth(clip, 0.0f, 1.0f, -10.0f);
+    std::vector<float> level(pyramidSize * pyramidSize);
+    for (int y = 0; y < pyramidSize; y++) {
+        for (int x = 0; x < pyramidSize; x++) {
+            level[y * pyramidSize + x] = (x < pyramidSize / 2) ? wallDepth : 1.0f;
+        }
+    }
+    for (int l = 0, size = pyramidSize; l < pyramidLevels; l++, size /= 2) {
+        if (l > 0) {
+            std::vector<float> coarser(size * size);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    const float* below = &level[2 * y * 2 * size + 2 * x];
+                    coarser[y * size + x] = std::max(std::max(below[0], below[1]),
+                            std::max(below[2 * size], below[2 * size + 1]));
+                }
+            }
+            level.swap(coarser);
+        }
+        glTextureSubImage2D(texture, l, 0, 0, size, size, GL_RED, GL_FLOAT, level.data());
+    }
+    return texture;
+}
+
+struct Expected
+{
+    const char* name;
+    bool frustumCulling;
+    bool occlusionCulling;
+    std::vector<GLuint> meshCells[meshCount];   // cell indices per mesh, sorted
+};
+
+// runs one dispatch like GpuCulling::cull; false if the results differ from the expected ones
+bool cull(GLuint program, GLuint buffers[3], GLuint pyramid, const Matrix& clip, GLuint cellCount,
+        const Command* emptyCommands, const Expected& expected)
+{
+    float planes[24];
+    frustumPlanes(clip, planes);
+    glNamedBufferSubData(buffers[2], 0, meshCount * sizeof(Command), emptyCommands);
+    glUseProgram(program);
+    glUniform1ui(glGetUniformLocation(program, "cell_count"), cellCount);
+    glUniform1i(glGetUniformLocation(program, "frustum_culling"), expected.frustumCulling);
+    glUniform4fv(glGetUniformLocation(program, "frustum_planes"), 6, planes);
+    glUniform1i(glGetUniformLocation(program, "occlusion_culling"), expected.occlusionCulling);
+    glUniformMatrix4fv(glGetUniformLocation(program, "pyramid_matrix"), 1, GL_FALSE, clip.m);
+    glBindTextureUnit(0, pyramid);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, buffers[1]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, buffers[2]);
+    glDispatchCompute((cellCount + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    Command commands[meshCount];
+    std::vector<GLuint> visible(meshCount * cellCount);
+    glGetNamedBufferSubData(buffers[2], 0, sizeof(commands), commands);
+    glGetNamedBufferSubData(buffers[1], 0, visible.size() * sizeof(GLuint), visible.data());
+
+    bool ok = true;
+    for (int mesh = 0; mesh < meshCount; mesh++) {
+        const Command& command = commands[mesh];
+        if (command.count != emptyCommands[mesh].count || command.firstIndex != emptyCommands[mesh].firstIndex
+                || command.baseVertex != emptyCommands[mesh].baseVertex
+                || command.baseInstance != emptyCommands[mesh].baseInstance) {
+            std::cerr << expected.name << ": command " << mesh << " changed beyond its instance count" << std::endl;
+            ok = false;
+        }
+        std::vector<GLuint> cells;
+        for (GLuint i = 0; i < std::min(command.instanceCount, cellCount); i++) {
+            GLuint entry = visible[command.baseInstance + i];
+            if (entry >> 30 != GLuint(mesh)) {
+                std::cerr << expected.name << ": entry of mesh " << (entry >> 30) << " in the range of mesh " << mesh << std::endl;
+                ok = false;
+            }
+            cells.push_back(entry & 0x3fffffffu);
+        }
+        // cells are appended in any order
+        std::sort(cells.begin(), cells.end());
+        if (command.instanceCount != expected.meshCells[mesh].size() || cells != expected.meshCells[mesh]) {
+            std::cerr << expected.name << ": mesh " << mesh << " has " << command.instanceCount << " visible cells:";
+            for (GLuint cell : cells) {
+                std::cerr << " " << cell;
+            }
+            std::cerr << ", expected " << expected.meshCells[mesh].size() << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " compute-shader-cull.glsl" << std::endl;
+        return 1;
+    }
+    std::string source;
+    if (!readFile(argv[1], source)) {
+        std::cerr << "Could not read " << argv[1] << std::endl;
+        return 1;
+    }
+    if (!createContext()) {
+        std::cerr << "Could not create an OpenGL 4.5 core context through EGL" << std::endl;
+        return 1;
+    }
+    std::cout << "renderer: " << glGetString(GL_RENDERER) << std::endl;
+    GLuint program = compileCullProgram(source);
+    if (!program) {
+        return 1;
+    }
+
+    // The camera stands at height 1 and looks along -z. The wall at z = -10 hides the left half
+    // of the pyramid, so cells behind it on the left are occluded and those on the right are not.
+    const Cell cells[] = {
+        { { 0.0f, -10.0f }, WALL, 0 },      // 0: in front of the camera
+        { { -6.0f, -20.0f }, EMPTY, 0 },    // 1: behind the wall depth
+        { { -6.0f, -30.0f }, COIN, 0 },     // 2: behind the wall depth
+        { { 0.0f, 10.0f }, EMPTY, 0 },      // 3: behind the camera
+        { { 6.0f, -20.0f }, COIN, 0 },      // 4: in front of the far plane
+        { { 6.0f, -30.0f }, DOOR, 0 },      // 5: in front of the far plane
+        { { 6.0f, -40.0f }, EMPTY, 0 },     // 6: in front of the far plane
+    };
+    const GLuint cellCount = sizeof(cells) / sizeof(cells[0]);
+    Matrix clip = multiply(perspective(60.0f, 0.1f, 100.0f), translation(0.0f, 1.0f, 0.0f));
+
+    // mesh i draws from the i-th range of cellCount visible cells
+    Command emptyCommands[meshCount];
+    const GLuint indexCounts[meshCount] = { 36, 6, 960 };
+    for (int mesh = 0; mesh < meshCount; mesh++) {
+        emptyCommands[mesh].count = indexCounts[mesh];
+        emptyCommands[mesh].instanceCount = 0;
+        emptyCommands[mesh].firstIndex = 100 * mesh;
+        emptyCommands[mesh].baseVertex = 10 * mesh;
+        emptyCommands[mesh].baseInstance = mesh * cellCount;
+    }
+    GLuint buffers[3];  // cells, visible cells and commands
+    glCreateBuffers(3, buffers);
+    glNamedBufferStorage(buffers[0], sizeof(cells), cells, 0);
+    glNamedBufferStorage(buffers[1], meshCount * cellCount * sizeof(GLuint), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(buffers[2], sizeof(emptyCommands), emptyCommands, GL_DYNAMIC_STORAGE_BIT);
+    GLuint pyramid = createPyramid(clip);
+
+    const Expected runs[] = {
+        { "no culling", false, false, { { 0, 5 }, { 1, 2, 3, 4, 6 }, { 2, 4 } } },
+        { "frustum culling", true, false, { { 0, 5 }, { 1, 2, 4, 6 }, { 2, 4 } } },
+        // a box that reaches behind the camera is never occluded
+        { "occlusion culling", false, true, { { 0, 5 }, { 3, 4, 6 }, { 4 } } },
+        { "frustum and occlusion culling", true, true, { { 0, 5 }, { 4, 6 }, { 4 } } },
+    };
+    bool ok = true;
+    for (const Expected& expected : runs) {
+        bool passed = cull(program, buffers, pyramid, clip, cellCount, emptyCommands, expected);
+        std::cout << expected.name << ": " << (passed ? "passed" : "FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    if (glGetError() != GL_NO_ERROR) {
+        std::cerr << "OpenGL error" << std::endl;
+        ok = false;
+    }
+
+    glDeleteTextures(1, &pyramid);
+    glDeleteBuffers(3, buffers);
+    glDeleteProgram(program);
+    return ok ? 0 : 1;
+}
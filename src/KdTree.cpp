@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <thread>
+
+#include "KdTree.hpp"
+
+
+namespace {
+
+// object range covered by a node, indexed like nodes
+struct Range
+{
+    int begin, end;
+};
+
+// levels with fewer objects are not worth starting threads for
+constexpr int minParallelObjects = 4096;
+
+float coordinate(const RenderObject& object, int axis)
+{
+    return (axis == 0) ? object.position.x : object.position.y;
+}
+
+// Partitions the object indices [first, last) around their median along axis and returns the
+// split border. Only the median is put in place, the halves themselves stay unordered.
+float splitRange(const std::vector<RenderObject>& objects, int* first, int* last, int axis)
+{
+    auto less = [&](int a, int b) {
+        return coordinate(objects[a], axis) < coordinate(objects[b], axis);
+    };
+    int count = last - first;
+    int* middle = first + count / 2;
+    std::nth_element(first, middle, last, less);
+    float border = coordinate(objects[*middle], axis);
+    if (count % 2 == 0) {
+        // the largest object of the left half is the lower median
+        border = (border + coordinate(objects[*std::max_element(first, middle, less)], axis)) / 2.0f;
+    }
+    return border;
+}
+
+}
+
+void KdTree::build(const std::vector<RenderObject>& renderObjects, unsigned int threads)
+{
+    int count = renderObjects.size();
+    nodes.clear();
+    parents.clear();
+    depths.clear();
+    objects.clear();
+    if (count == 0) {
+        bounds.clear();
+        flags.clear();
+        visibleBits.clear();
+        histories.clear();
+        currentView = 0;
+        return;
+    }
+
+    // the tree is built by partitioning one index buffer in place
+    std::vector<int> indices(count);
+    for (int i = 0; i < count; i++) {
+        indices[i] = i;
+    }
+    // a tree over n objects has exactly 2n - 1 nodes, so all of them are allocated up front
+    std::vector<Range> ranges;
+    nodes.reserve(2 * count - 1);
+    parents.reserve(2 * count - 1);
+    depths.reserve(2 * count - 1);
+    ranges.reserve(2 * count - 1);
+
+    nodes.push_back(KdNode());
+    parents.push_back(-1);
+    depths.push_back(0);
+    ranges.push_back({ 0, count });
+
+    // nodes of one level cover disjoint index ranges and are split independently
+    auto splitNodes = [&](int begin, int end) {
+        for (int node = begin; node < end; node++) {
+            Range range = ranges[node];
+            if (range.end - range.begin == 1) {
+                nodes[node].axis = -1;
+                nodes[node].border = 0.0f;
+                nodes[node].child = range.begin;
+            } else {
+                int axis = depths[node] % 2;
+                nodes[node].axis = axis;
+                nodes[node].border = splitRange(renderObjects, indices.data() + range.begin, indices.data() + range.end, axis);
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = 1;
+    }
+    int levelBegin = 0;
+    while (levelBegin < (int)nodes.size()) {
+        int levelEnd = nodes.size();
+        int levelThreads = std::min<int>(threads, levelEnd - levelBegin);
+        if (levelThreads > 1 && count >= minParallelObjects) {
+            std::vector<std::thread> workers;
+            for (int t = 1; t < levelThreads; t++) {
+                workers.emplace_back(splitNodes,
+                        levelBegin + (levelEnd - levelBegin) * t / levelThreads,
+                        levelBegin + (levelEnd - levelBegin) * (t + 1) / levelThreads);
+            }
+            splitNodes(levelBegin, levelBegin + (levelEnd - levelBegin) / levelThreads);
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        } else {
+            splitNodes(levelBegin, levelEnd);
+        }
+
+        // children are appended behind the current level, which gives breadth-first order
+        for (int node = levelBegin; node < levelEnd; node++) {
+            if (nodes[node].axis < 0) continue;
+            Range range = ranges[node];
+            int middle = range.begin + (range.end - range.begin) / 2;
+            int child = nodes.size();
+            nodes[node].child = child;
+            nodes.resize(child + 2);
+            parents.push_back(node);
+            parents.push_back(node);
+            depths.push_back(depths[node] + 1);
+            depths.push_back(depths[node] + 1);
+            ranges.push_back({ range.begin, middle });
+            ranges.push_back({ middle, range.end });
+        }
+        levelBegin = levelEnd;
+    }
+
+    // store the objects in leaf order
+    objects.reserve(count);
+    for (int index : indices) {
+        objects.push_back(renderObjects[index]);
+    }
+
+    bounds.resize(nodes.size());
+    flags.assign(nodes.size(), IN_FRUSTUM);
+    visibleBits.clear();
+    histories.clear();
+    selectView(0);
+}
+
+void KdTree::selectView(int view)
+{
+    while ((int)visibleBits.size() <= view) {
+        visibleBits.emplace_back((nodes.size() + 63) / 64, ~uint64_t(0));
+        histories.emplace_back(nodes.size(), NodeHistory());
+    }
+    currentView = view;
+}
+
+void KdTree::setFlagAll(Flag flag, bool value)
+{
+    for (auto& nodeFlags : flags) {
+        if (value) {
+            nodeFlags |= flag;
+        } else {
+            nodeFlags &= ~flag;
+        }
+    }
+}
+
+Bounds unite(const Bounds& a, const Bounds& b)
+{
+    Bounds bounds;
+    bounds.xMin = std::min(a.xMin, b.xMin);
+    bounds.xMax = std::max(a.xMax, b.xMax);
+    bounds.yMin = std::min(a.yMin, b.yMin);
+    bounds.yMax = std::max(a.yMax, b.yMax);
+    bounds.heightMin = std::min(a.heightMin, b.heightMin);
+    bounds.heightMax = std::max(a.heightMax, b.heightMax);
+    return bounds;
+}
+
+Bounds objectBounds(const RenderObject& object)
+{
+    Bounds bounds;
+    bounds.xMin = object.position.x - 1.0f;
+    bounds.xMax = object.position.x + 1.0f;
+    bounds.yMin = object.position.y - 1.0f;
+    bounds.yMax = object.position.y + 1.0f;
+    bounds.heightMin = 0.0f;
+    if (object.type == GridCell::WALL || object.type == GridCell::DOOR) {
+        bounds.heightMax = cellHeight;
+    } else if (object.type == GridCell::COIN) {
+        bounds.heightMax = coinHeight;
+    } else {
+        // floor tiles are flat
+        bounds.heightMax = 0.0f;
+    }
+    return bounds;
+}
+
+void calcBorders(KdTree& tree)
+{
+    // children follow their parents in breadth-first order, so a reverse sweep sees them first
+    for (int node = tree.size() - 1; node >= 0; node--) {
+        if (tree.isLeaf(node)) {
+            tree.bounds[node] = objectBounds(tree.object(node));
+        } else {
+            tree.bounds[node] = unite(tree.bounds[tree.left(node)], tree.bounds[tree.right(node)]);
+        }
+    }
+}
+
+void refitBounds(KdTree& tree, int node)
+{
+    tree.bounds[node] = objectBounds(tree.object(node));
+    // ancestors above the first unchanged box keep their bounds
+    for (node = tree.parent(node); node >= 0; node = tree.parent(node)) {
+        Bounds bounds = unite(tree.bounds[tree.left(node)], tree.bounds[tree.right(node)]);
+        const Bounds& old = tree.bounds[node];
+        if (bounds.xMin == old.xMin && bounds.xMax == old.xMax && bounds.yMin == old.yMin && bounds.yMax == old.yMax
+                && bounds.heightMin == old.heightMin && bounds.heightMax == old.heightMax) {
+            break;
+        }
+        tree.bounds[node] = bounds;
+    }
+}
+
+void pullUp(KdTree& tree, int node)
+{
+    // a parent becomes invisible once both of its children are
+    while (tree.parent(node) >= 0 && !tree.visible(node)) {
+        int parent = tree.parent(node);
+        int sibling = (tree.left(parent) == node) ? tree.right(parent) : tree.left(parent);
+        if (tree.visible(sibling)) {
+            break;
+        }
+        tree.setVisible(parent, false);
+        node = parent;
+    }
+}
+
+void pullUpVisibility(KdTree& tree, int node)
+{
+    while (node >= 0 && !tree.visible(node)) {
+        tree.setVisible(node, true);
+        node = tree.parent(node);
+    }
+}
+
+void frustumPlanes(const QMatrix4x4& clipMatrix, QVector4D* planes)
+{
+    // planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside, see Gribb & Hartmann
+    QVector4D row0 = clipMatrix.row(0);
+    QVector4D row1 = clipMatrix.row(1);
+    QVector4D row2 = clipMatrix.row(2);
+    QVector4D row3 = clipMatrix.row(3);
+    planes[0] = row3 + row0;    // left
+    planes[1] = row3 - row0;    // right
+    planes[2] = row3 + row1;    // bottom
+    planes[3] = row3 - row1;    // top
+    planes[4] = row3 + row2;    // near
+    planes[5] = row3 - row2;    // far
+}
+
+void frustumCull(KdTree& tree, int node, const QVector4D* planes, unsigned int planeMask)
+{
+    const Bounds& bounds = tree.bounds[node];
+    // only test the planes that do not contain the parent completely
+    for (int i = 0; i < 6; i++) {
+        if (!(planeMask & (1u << i))) continue;
+        const QVector4D& plane = planes[i];
+        // corners of the box furthest along and against the plane normal; the grid y is the world z
+        float px = plane.x() > 0.0f ? bounds.xMax : bounds.xMin;
+        float py = plane.y() > 0.0f ? bounds.heightMax : bounds.heightMin;
+        float pz = plane.z() > 0.0f ? bounds.yMax : bounds.yMin;
+        if (plane.x() * px + plane.y() * py + plane.z() * pz + plane.w() < 0.0f) {
+            // completely outside, the subtree is never visited
+            tree.setInFrustum(node, false);
+            return;
+        }
+        float nx = plane.x() > 0.0f ? bounds.xMin : bounds.xMax;
+        float ny = plane.y() > 0.0f ? bounds.heightMin : bounds.heightMax;
+        float nz = plane.z() > 0.0f ? bounds.yMin : bounds.yMax;
+        if (plane.x() * nx + plane.y() * ny + plane.z() * nz + plane.w() >= 0.0f) {
+            planeMask &= ~(1u << i);
+        }
+    }
+    tree.setInFrustum(node, true);
+    if (!tree.isLeaf(node)) {
+        frustumCull(tree, tree.left(node), planes, planeMask);
+        frustumCull(tree, tree.right(node), planes, planeMask);
+    }
+}
+
+void frustumCullStereo(KdTree& tree, int node, const QVector4D* planes, unsigned int planeMask)
+{
+    const Bounds& bounds = tree.bounds[node];
+    bool inFrustum = false;
+    for (int frustum = 0; frustum < 2; frustum++) {
+        unsigned int outsideBit = 1u << (12 + frustum);
+        if (planeMask & outsideBit) continue;
+        for (int i = 6 * frustum; i < 6 * frustum + 6; i++) {
+            if (!(planeMask & (1u << i))) continue;
+            const QVector4D& plane = planes[i];
+            float px = plane.x() > 0.0f ? bounds.xMax : bounds.xMin;
+            float py = plane.y() > 0.0f ? bounds.heightMax : bounds.heightMin;
+            float pz = plane.z() > 0.0f ? bounds.yMax : bounds.yMin;
+            if (plane.x() * px + plane.y() * py + plane.z() * pz + plane.w() < 0.0f) {
+                planeMask |= outsideBit;
+                break;
+            }
+            float nx = plane.x() > 0.0f ? bounds.xMin : bounds.xMax;
+            float ny = plane.y() > 0.0f ? bounds.heightMin : bounds.heightMax;
+            float nz = plane.z() > 0.0f ? bounds.yMin : bounds.yMax;
+            if (plane.x() * nx + plane.y() * ny + plane.z() * nz + plane.w() >= 0.0f) {
+                planeMask &= ~(1u << i);
+            }
+        }
+        inFrustum = inFrustum || !(planeMask & outsideBit);
+    }
+    tree.setInFrustum(node, inFrustum);
+    if (inFrustum && !tree.isLeaf(node)) {
+        frustumCullStereo(tree, tree.left(node), planes, planeMask);
+        frustumCullStereo(tree, tree.right(node), planes, planeMask);
+    }
+}
+
+bool intersectsFrustum(const Bounds& bounds, const QVector4D* planes)
+{
+    for (int i = 0; i < 6; i++) {
+        const QVector4D& plane = planes[i];
+        float px = plane.x() > 0.0f ? bounds.xMax : bounds.xMin;
+        float py = plane.y() > 0.0f ? bounds.heightMax : bounds.heightMin;
+        float pz = plane.z() > 0.0f ? bounds.yMax : bounds.yMin;
+        if (plane.x() * px + plane.y() * py + plane.z() * pz + plane.w() < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hiZOccluded(const Bounds& bounds, const QMatrix4x4& viewProjectionMatrix, const std::vector<DepthLevel>& levels)
+{
+    // the rasterized depth of a face is rounded, so a box must lie clearly behind to be hidden
+    constexpr float depthBias = 1.0f / 65536.0f;
+
+    if (levels.empty()) return false;
+    float ndcMin[3] = { 1.0f, 1.0f, 1.0f };
+    float ndcMax[3] = { -1.0f, -1.0f, -1.0f };
+    for (int i = 0; i < 8; i++) {
+        QVector4D corner((i & 1) ? bounds.xMax : bounds.xMin,
+                (i & 2) ? bounds.heightMax : bounds.heightMin,
+                (i & 4) ? bounds.yMax : bounds.yMin, 1.0f);
+        QVector4D clip = viewProjectionMatrix * corner;
+        if (clip.w() <= 0.0f) {
+            // reaches behind the camera
+            return false;
+        }
+        for (int j = 0; j < 3; j++) {
+            float ndc = clip[j] / clip.w();
+            ndcMin[j] = std::min(ndcMin[j], ndc);
+            ndcMax[j] = std::max(ndcMax[j], ndc);
+        }
+    }
+    if (ndcMin[0] < -1.0f || ndcMin[1] < -1.0f || ndcMax[0] > 1.0f || ndcMax[1] > 1.0f) {
+        // partly outside the view, where nothing can hide it
+        return false;
+    }
+
+    // the finest level at which the box touches at most 3x3 texels
+    const DepthLevel& finest = levels.front();
+    int xMin = std::min((int)((ndcMin[0] * 0.5f + 0.5f) * finest.width), finest.width - 1);
+    int yMin = std::min((int)((ndcMin[1] * 0.5f + 0.5f) * finest.height), finest.height - 1);
+    int xMax = std::min((int)((ndcMax[0] * 0.5f + 0.5f) * finest.width), finest.width - 1);
+    int yMax = std::min((int)((ndcMax[1] * 0.5f + 0.5f) * finest.height), finest.height - 1);
+    int extent = std::max(xMax - xMin, yMax - yMin) + 1;
+    int level = 0;
+    while ((2 << level) < extent && level + 1 < (int)levels.size()) {
+        level++;
+    }
+    const DepthLevel& depth = levels[level];
+    float maxDepth = 0.0f;
+    for (int y = std::min(yMin >> level, depth.height - 1); y <= std::min(yMax >> level, depth.height - 1); y++) {
+        for (int x = std::min(xMin >> level, depth.width - 1); x <= std::min(xMax >> level, depth.width - 1); x++) {
+            maxDepth = std::max(maxDepth, depth.depth[y * depth.width + x]);
+        }
+    }
+    return ndcMin[2] * 0.5f + 0.5f > maxDepth + depthBias;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <QVector3D>
+#include <QVector4D>
+#include <QMatrix4x4>
+
+enum class GridCell : int
+{
+    EMPTY,
+    WALL,
+    FINISH,
+    SPAWN,
+    COIN,
+    DOOR
+};
+
+constexpr int gridCellTypes = 6;     // number of GridCell values
+
+struct Point
+{
+    float x;
+    float y;
+
+    Point(float x, float y)
+        :x(x), y(y)
+    {
+
+    }
+};
+
+struct RenderObject
+{
+    Point position = Point(0.0,0.0);
+    GridCell type;
+};
+
+constexpr float cellHeight = 2.0f;      // walls span 0..cellHeight in world y
+constexpr float coinHeight = 1.35f;     // upper end of a spinning coin
+constexpr unsigned int allFrustumPlanes = 0x3f;
+constexpr unsigned int allStereoFrustumPlanes = 0xfff;
+constexpr int maxTreeDepth = 64;        // bounds the traversal stacks
+
+// Axis-aligned box in grid coordinates; the height is along the world y axis
+struct Bounds
+{
+    float xMin, xMax;
+    float yMin, yMax;
+    float heightMin, heightMax;
+};
+
+// One level of a maximum depth pyramid read back from the GPU, row by row from the bottom
+struct DepthLevel
+{
+    int width;
+    int height;
+    std::vector<float> depth;   // window depth in [0, 1]
+};
+
+// Split data read by every traversal. The children of a node are stored next to each other.
+struct KdNode
+{
+    float border;
+    int axis;       // 0 = x, 1 = y, -1 for leaves
+    int child;      // index of the left child, the right child follows it; object index for leaves
+};
+
+// CHC++ bookkeeping
+struct NodeHistory
+{
+    int lastVisited = -1;       // frame in which the traversal last reached this node
+    int nextQueryFrame = 0;     // frame in which a visible leaf is queried again
+    int invisibleFrames = 0;    // number of consecutive frames this node was found invisible
+};
+
+// kd-tree over the render objects. Nodes live in flat arrays in breadth-first order and are
+// referred to by index; hot split data, cold data and per-frame state are kept apart.
+struct KdTree
+{
+    enum Flag : unsigned char
+    {
+        RENDERED = 2,
+        IN_FRUSTUM = 4  // set by frustumCull, stale below nodes outside the frustum
+    };
+
+    // hot data
+    std::vector<KdNode> nodes;
+    std::vector<Bounds> bounds;
+    // cold data
+    std::vector<int> parents;
+    std::vector<int> depths;
+    std::vector<RenderObject> objects;  // in leaf order
+    // per-frame state
+    std::vector<unsigned char> flags;
+    // Visibility and CHC++ history of each view, one bit and one NodeHistory per node. The
+    // functions without a view argument use the view chosen with selectView().
+    std::vector<std::vector<uint64_t>> visibleBits;
+    std::vector<std::vector<NodeHistory>> histories;
+    int currentView = 0;
+
+    // splits each tree level across up to threads worker threads
+    void build(const std::vector<RenderObject>& renderObjects, unsigned int threads = 1);
+
+    int root() const { return 0; }
+    int size() const { return nodes.size(); }
+    bool isLeaf(int node) const { return nodes[node].axis < 0; }
+    int left(int node) const { return nodes[node].child; }
+    int right(int node) const { return nodes[node].child + 1; }
+    int parent(int node) const { return parents[node]; }
+    RenderObject& object(int node) { return objects[nodes[node].child]; }
+    const RenderObject& object(int node) const { return objects[nodes[node].child]; }
+
+    // makes a view current, adding it with all nodes visible if it is new
+    void selectView(int view);
+    int viewCount() const { return visibleBits.size(); }
+    bool visible(int view, int node) const { return (visibleBits[view][node / 64] >> (node % 64)) & 1u; }
+    void setVisible(int view, int node, bool value)
+    {
+        if (value) {
+            visibleBits[view][node / 64] |= uint64_t(1) << (node % 64);
+        } else {
+            visibleBits[view][node / 64] &= ~(uint64_t(1) << (node % 64));
+        }
+    }
+    NodeHistory& history(int view, int node) { return histories[view][node]; }
+
+    bool visible(int node) const { return visible(currentView, node); }
+    bool rendered(int node) const { return flags[node] & RENDERED; }
+    bool inFrustum(int node) const { return flags[node] & IN_FRUSTUM; }
+    void setVisible(int node, bool value) { setVisible(currentView, node, value); }
+    NodeHistory& history(int node) { return histories[currentView][node]; }
+    void setRendered(int node, bool value) { setFlag(node, RENDERED, value); }
+    void setInFrustum(int node, bool value) { setFlag(node, IN_FRUSTUM, value); }
+    void setFlag(int node, Flag flag, bool value)
+    {
+        if (value) {
+            flags[node] |= flag;
+        } else {
+            flags[node] &= ~flag;
+        }
+    }
+    void setFlagAll(Flag flag, bool value);
+};
+
+Bounds unite(const Bounds& a, const Bounds& b);
+Bounds objectBounds(const RenderObject& object);
+void calcBorders(KdTree& tree);
+// updates the bounds of a leaf after its object changed, and those of its ancestors
+void refitBounds(KdTree& tree, int node);
+void pullUp(KdTree& tree, int node);
+void pullUpVisibility(KdTree& tree, int node);
+
+void frustumPlanes(const QMatrix4x4& clipMatrix, QVector4D* planes);
+void frustumCull(KdTree& tree, int node, const QVector4D* planes, unsigned int planeMask = allFrustumPlanes);
+// Like frustumCull for the union of two frusta, e.g. of both eyes: planes[0..5] and planes[6..11].
+// Bits 0..11 of planeMask are the planes still to test, bits 12 and 13 the frusta that already
+// excluded an ancestor.
+void frustumCullStereo(KdTree& tree, int node, const QVector4D* planes, unsigned int planeMask = allStereoFrustumPlanes);
+// false if the box lies completely outside one of the planes
+bool intersectsFrustum(const Bounds& bounds, const QVector4D* planes);
+// true if the box lies behind the depth of a pyramid rendered with viewProjectionMatrix; levels
+// start at the finest one and halve their size like mip levels
+bool hiZOccluded(const Bounds& bounds, const QMatrix4x4& viewProjectionMatrix, const std::vector<DepthLevel>& levels);
+
+template<typename Func>
+void frontToBack(const KdTree& tree, const QVector3D& eye, Func f)
+{
+    if (tree.size() == 0) return;
+
+    int stack[maxTreeDepth + 1];
+    int top = 0;
+    stack[top++] = tree.root();
+    while (top > 0) {
+        int node = stack[--top];
+        bool stop = f(node);
+        if (stop || tree.isLeaf(node)) continue;
+        // the grid y axis is the world z axis
+        const KdNode& kdNode = tree.nodes[node];
+        float eyeCoord = (kdNode.axis == 0) ? eye.x() : eye.z();
+        if (eyeCoord < kdNode.border) {
+            stack[top++] = tree.right(node);
+            stack[top++] = tree.left(node);
+        } else {
+            stack[top++] = tree.left(node);
+            stack[top++] = tree.right(node);
+        }
+    }
+}
+
+template<typename Func>
+void inOrder(const KdTree& tree, int node, Func f)
+{
+    if (tree.size() == 0) return;
+
+    int stack[maxTreeDepth + 1];
+    int top = 0;
+    while (top > 0 || node >= 0) {
+        if (node >= 0) {
+            stack[top++] = node;
+            node = tree.isLeaf(node) ? -1 : tree.left(node);
+        } else {
+            node = stack[--top];
+            f(node);
+            node = tree.isLeaf(node) ? -1 : tree.right(node);
+        }
+    }
+}
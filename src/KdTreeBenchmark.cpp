@@ -0,0 +1,63 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+
+#include "KdTree.hpp"
+
+// Builds kd-trees over completely filled square grids and prints the build times.
+// Usage: kdtree-benchmark [threads]
+
+static std::vector<RenderObject> gridObjects(int gridSize)
+{
+    std::vector<RenderObject> objects;
+    objects.reserve(gridSize * gridSize);
+    for (int row = 0; row < gridSize; row++) {
+        for (int col = 0; col < gridSize; col++) {
+            RenderObject object;
+            float x = -((float)gridSize)+1.0f + 2.0f * col;
+            float y = ((float)gridSize)-1.0f - 2.0f * row;
+            object.position = Point(x, y);
+            object.type = (row % 2 == 0 || col % 2 == 0) ? GridCell::WALL : GridCell::EMPTY;
+            objects.push_back(object);
+        }
+    }
+    return objects;
+}
+
+static double buildSeconds(const std::vector<RenderObject>& objects, unsigned int threads, int runs)
+{
+    double best = 0.0;
+    for (int run = 0; run < runs; run++) {
+        KdTree tree;
+        auto start = std::chrono::steady_clock::now();
+        tree.build(objects, threads);
+        calcBorders(tree);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        if (run == 0 || seconds.count() < best) {
+            best = seconds.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+    if (argc > 1) {
+        threads = std::stoi(argv[1]);
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    std::cout << "grid        objects    1 thread   " << threads << " threads" << std::endl;
+    for (int gridSize = 64; gridSize <= 2048; gridSize *= 2) {
+        std::vector<RenderObject> objects = gridObjects(gridSize);
+        int runs = (gridSize <= 512) ? 5 : 1;
+        double serial = buildSeconds(objects, 1, runs);
+        double parallel = buildSeconds(objects, threads, runs);
+        std::cout << gridSize << "x" << gridSize << "\t" << objects.size()
+            << "\t" << serial * 1000.0 << " ms\t" << parallel * 1000.0 << " ms" << std::endl;
+    }
+    return 0;
+}
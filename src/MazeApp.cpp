@@ -1,5 +1,10 @@
 #include <iostream>
+#include <algorithm>
 #include <queue>
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <thread>
 
 #include <QGuiApplication>
 #include <QKeyEvent>
@@ -10,13 +15,11 @@
 #include <qvr/observer.hpp>
 #include <qvr/device.hpp>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
 #include "MazeApp.hpp"
+#include "MazeFile.hpp"
 
 
 MazeApp::MazeApp() :
@@ -32,45 +35,35 @@ bool MazeApp::initProcess(QVRProcess* p)
     }*/
 
     initializeOpenGLFunctions();
-
-    int mazeWidth, mazeHeight, channels;
-    // load maze layout
-    unsigned char* mazeImage = stbi_load("maze.bmp", &mazeWidth, &mazeHeight, &channels, 0);
-    if (!mazeImage) {
-        qCritical("Could not load maze layout");
-    }
-    mazeGrid = new GridCell[mazeWidth * mazeHeight];
-    renderQueue.reserve(mazeWidth * mazeHeight);
-    gridHeight = mazeHeight;
-    gridWidth = mazeWidth;
-    for (int cell = 0; cell < gridHeight * gridWidth; cell++) {
-        // map bmp color to cell type
-        // white => empty, red => wall, green => finish, black => spawn
-        bool red, green, blue;
-        red = mazeImage[channels*cell + 0];
-        green = mazeImage[channels * cell + 1];
-        blue = mazeImage[channels * cell + 2];
-
-        if (red && green && blue) {
-            mazeGrid[cell] = GridCell::EMPTY;
-        } else if (red && !green && !blue) {
-            mazeGrid[cell] = GridCell::WALL;
-        } else if (!red && green && !blue) {
-            mazeGrid[cell] = GridCell::FINISH;
-        } else if (!red && !green && !blue) {
-            mazeGrid[cell] = GridCell::SPAWN;
-        } else if (red && green && !blue) {
-            mazeGrid[cell] = GridCell::COIN;
-            coinsLeft++;
-        } else if (!red && !green && blue) {
-            mazeGrid[cell] = GridCell::DOOR;
+    queryPool.init();
+
+    // load maze layout: the packed level file if there is one, otherwise the maze image
+    MazeFile mazeFile;
+    if (QFile::exists("maze.maze") && mazeFile.open("maze.maze")) {
+        gridWidth = mazeFile.width();
+        gridHeight = mazeFile.height();
+        mazeGrid = new GridCell[gridWidth * gridHeight];
+        mazeFile.unpack(mazeGrid);
+        mazeFile.loadPvs(pvs);
+        mazeFile.close();
+    } else {
+        std::vector<GridCell> mazeCells;
+        int mazeWidth = 0, mazeHeight = 0;
+        if (!readMazeImage("maze.bmp", mazeCells, mazeWidth, mazeHeight)) {
+            qCritical("Could not load maze layout");
         }
+        gridWidth = mazeWidth;
+        gridHeight = mazeHeight;
+        mazeGrid = new GridCell[gridWidth * gridHeight];
+        std::copy(mazeCells.begin(), mazeCells.end(), mazeGrid);
     }
-    stbi_image_free(mazeImage);
+    renderQueue.reserve(gridWidth * gridHeight);
+    portalGraph.build(mazeGrid, gridWidth, gridHeight);
+    chunkStreamer.start(mazeGrid, gridWidth, gridHeight, maxResidentChunks);
 
     // fill render queue
-    for (int row = 0; row < gridWidth; row++) {
-        for (int col = 0; col < gridHeight; col++) {
+    for (int row = 0; row < gridHeight; row++) {
+        for (int col = 0; col < gridWidth; col++) {
             RenderObject object;
             float x = -((float)gridWidth)+1.0f + 2.0f * col;
             float y = ((float)gridHeight)-1.0f - 2.0f * row;
@@ -80,17 +73,35 @@ bool MazeApp::initProcess(QVRProcess* p)
         }
     }
 
-    kdTreeRoot = kdTree(renderQueue);
-    calcBorders(kdTreeRoot);
+    kdTree.build(renderQueue, std::thread::hardware_concurrency());
+    calcBorders(kdTree);
+
+    // grid cell -> kd-tree object, for direct lookups around the player
+    cellObjects.resize(gridWidth * gridHeight);
+    for (int i = 0; i < (int)kdTree.objects.size(); i++) {
+        const Point& position = kdTree.objects[i].position;
+        int row = std::lround((gridHeight - 1.0f - position.y) / 2.0f);
+        int col = std::lround((position.x + gridWidth - 1.0f) / 2.0f);
+        cellObjects[row * gridWidth + col] = i;
+    }
+    world.init(kdTree);
+    if (world.count(GridCell::COIN) == 0) {
+        openDoors();
+    }
+
+    // Framebuffer objects, created per window view on first use
+    renderTargets.init();
 
-    // Framebuffer object
-    glGenFramebuffers(1, &_fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
-    glGenTextures(1, &_fboDepthTex);
-    glBindTexture(GL_TEXTURE_2D, _fboDepthTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 1, 1,
-            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, _fboDepthTex, 0);
+    // Per-frame object data, with room for the cells and materials of the resident chunks or of
+    // the whole maze if it is smaller; it grows when a frame draws more
+    objectData.init(std::min<size_t>(2 * renderQueue.size(),
+            maxResidentChunks * (MazeMesher::chunkSize * MazeMesher::chunkSize + gridCellTypes)));
+    glGenBuffers(1, &_viewUniformBuf);
+    glBindBuffer(GL_UNIFORM_BUFFER, _viewUniformBuf);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(ViewData), NULL, GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &_stereoViewUniformBuf);
+    glBindBuffer(GL_UNIFORM_BUFFER, _stereoViewUniformBuf);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(StereoViewData), NULL, GL_DYNAMIC_DRAW);
 
     // Vertex array object
     static const GLfloat wallVertices[] = {
@@ -131,46 +142,6 @@ bool MazeApp::initProcess(QVRProcess* p)
     };
 
 
-    glGenVertexArrays(1, &_vaoWall);
-    glBindVertexArray(_vaoWall);
-    GLuint positionBuf;
-    glGenBuffers(1, &positionBuf);
-    glBindBuffer(GL_ARRAY_BUFFER, positionBuf);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(wallVertices), wallVertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    GLuint normalBuf;
-    glGenBuffers(1, &normalBuf);
-    glBindBuffer(GL_ARRAY_BUFFER, normalBuf);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(wallNormals), wallNormals, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, 0);
-    glEnableVertexAttribArray(1);
-    GLuint indexBuf;
-    glGenBuffers(1, &indexBuf);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuf);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(wallIndices), wallIndices, GL_STATIC_DRAW);
-    _vaoIndicesWall = 36;
-
-    glGenVertexArrays(1, &_vaoFloor);
-    glBindVertexArray(_vaoFloor);
-    GLuint positionBufFloor;
-    glGenBuffers(1, &positionBufFloor);
-    glBindBuffer(GL_ARRAY_BUFFER, positionBufFloor);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(floorVertices), floorVertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    GLuint normalBufFloor;
-    glGenBuffers(1, &normalBufFloor);
-    glBindBuffer(GL_ARRAY_BUFFER, normalBufFloor);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(floorNormals), floorNormals, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, 0);
-    glEnableVertexAttribArray(1);
-    GLuint indexBufFloor;
-    glGenBuffers(1, &indexBufFloor);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufFloor);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(floorIndices), floorIndices, GL_STATIC_DRAW);
-    _vaoIndicesFloor = 6;
-
     std::string inputfile = "goldCoin.wavefront";
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -218,26 +189,53 @@ bool MazeApp::initProcess(QVRProcess* p)
 
     coinBoundingSphere *= 2.0f;
 
-    glGenVertexArrays(1, &_vaoCoin);
-    glBindVertexArray(_vaoCoin);
-    GLuint coinPosBuffer;
-    glGenBuffers(1, &coinPosBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, coinPosBuffer);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    // all meshes share one set of buffers, so one multi-draw covers them all
+    std::vector<float> meshVertices;
+    std::vector<float> meshNormals;
+    std::vector<unsigned int> meshIndices;
+    auto addMesh = [&](const float* positions, const float* normals, size_t vertexCount,
+            const unsigned int* indices, size_t indexCount) {
+        Mesh mesh;
+        mesh.indexCount = indexCount;
+        mesh.firstIndex = meshIndices.size();
+        mesh.baseVertex = meshVertices.size() / 3;
+        meshVertices.insert(meshVertices.end(), positions, positions + 3 * vertexCount);
+        meshNormals.insert(meshNormals.end(), normals, normals + 3 * vertexCount);
+        meshIndices.insert(meshIndices.end(), indices, indices + indexCount);
+        return mesh;
+    };
+    _meshWall = addMesh(wallVertices, wallNormals, 24, wallIndices, 36);
+    _meshFloor = addMesh(floorVertices, floorNormals, 4, floorIndices, 6);
+    _meshCoin = addMesh(vertices.data(), normals.data(), vertices.size() / 3, indices.data(), indices.size());
+
+    glGenVertexArrays(1, &_vao);
+    glBindVertexArray(_vao);
+    GLuint positionBuf;
+    glGenBuffers(1, &positionBuf);
+    glBindBuffer(GL_ARRAY_BUFFER, positionBuf);
+    glBufferData(GL_ARRAY_BUFFER, meshVertices.size() * sizeof(float), meshVertices.data(), GL_STATIC_DRAW);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
     glEnableVertexAttribArray(0);
-    GLuint coinNormalBuffer;
-    glGenBuffers(1, &coinNormalBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, coinNormalBuffer);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_STATIC_DRAW);
+    GLuint normalBuf;
+    glGenBuffers(1, &normalBuf);
+    glBindBuffer(GL_ARRAY_BUFFER, normalBuf);
+    glBufferData(GL_ARRAY_BUFFER, meshNormals.size() * sizeof(float), meshNormals.data(), GL_STATIC_DRAW);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, 0);
     glEnableVertexAttribArray(1);
-
-    GLuint coinIndexBuffer;
-    glGenBuffers(1, &coinIndexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, coinIndexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
-    _coinSize = indices.size();
+    GLuint indexBuf;
+    glGenBuffers(1, &indexBuf);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuf);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshIndices.size() * sizeof(unsigned int), meshIndices.data(), GL_STATIC_DRAW);
+    objectData.attach(_vao);
+    chunkBuffers.init(chunkStreamer.chunkCount(), maxResidentChunks);
+    objectData.attach(chunkBuffers.vertexArray());
+    chunkViews.assign(chunkStreamer.chunkCount(), 0);
+
+    // GPU culling draws the same meshes with cells instead of object data
+    depthPyramid.init();
+    const Mesh meshes[] = { _meshWall, _meshFloor, _meshCoin };
+    gpuCulling.init(kdTree, positionBuf, normalBuf, indexBuf, meshes);
+    coinBuffer.init(kdTree);
 
     // Shader program
     _prg.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader.glsl");
@@ -245,6 +243,28 @@ bool MazeApp::initProcess(QVRProcess* p)
     if (!_prg.link()) {
         qCritical("Could not link program! Check shaders!");
     }
+    _prgObjects.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader-objects.glsl");
+    _prgObjects.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!_prgObjects.link()) {
+        qCritical("Could not link object program! Check shaders!");
+    }
+    _prgObjectsStereo.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader-objects-stereo.glsl");
+    _prgObjectsStereo.addShaderFromSourceFile(QOpenGLShader::Geometry, ":geometry-shader-stereo.glsl");
+    _prgObjectsStereo.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!_prgObjectsStereo.link()) {
+        qCritical("Could not link stereo object program! Check shaders!");
+    }
+    _prgCoins.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader-coins.glsl");
+    _prgCoins.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!_prgCoins.link()) {
+        qCritical("Could not link coin program! Check shaders!");
+    }
+    _prgCoinsStereo.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader-coins-stereo.glsl");
+    _prgCoinsStereo.addShaderFromSourceFile(QOpenGLShader::Geometry, ":geometry-shader-stereo.glsl");
+    _prgCoinsStereo.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!_prgCoinsStereo.link()) {
+        qCritical("Could not link stereo coin program! Check shaders!");
+    }
 
     mousePosLastFrame = QCursor::pos();
 
@@ -254,17 +274,48 @@ bool MazeApp::initProcess(QVRProcess* p)
 void MazeApp::render(QVRWindow*  w ,
         const QVRRenderContext& context, const unsigned int* textures)
 {
+    constexpr size_t instanceBatchSize = 256;  // pending instances before flushing ahead of a query
+
+    objectData.beginFrame();
+    world.takeChangedObjects(changedObjects);
+    gpuCulling.updateCells(kdTree, changedObjects);
+    coinBuffer.update(kdTree, changedObjects);
+    for (int object : changedObjects) {
+        const Point& position = kdTree.objects[object].position;
+        int row = std::lround((gridHeight - 1.0f - position.y) / 2.0f);
+        int col = std::lround((position.x + gridWidth - 1.0f) / 2.0f);
+        chunkStreamer.setCell(row, col, kdTree.objects[object].type);
+    }
+    if (mergedGeometry) {
+        // stream the chunks around the player; cells of chunks that are not resident yet are
+        // drawn as objects
+        int playerRow = std::floor((gridHeight - playerPosition.z()) / 2.0f);
+        int playerCol = std::floor((playerPosition.x() + gridWidth) / 2.0f);
+        chunkStreamer.update(playerRow, playerCol, streamRadius, evictedChunks);
+        for (int chunk : evictedChunks) {
+            chunkBuffers.evict(chunk);
+        }
+        chunkStreamer.takeLoaded(loadedChunks);
+        for (const ChunkMesh& mesh : loadedChunks) {
+            chunkBuffers.upload(mesh);
+        }
+    }
+    // Single-pass stereo covers the modes whose culling does not keep state per view; the
+    // others render each view on its own.
+    if (singlePassStereo && context.viewCount() == 2 && w->id() != "debug"
+            && occlusionMode == OcclusionMode::NONE && context.textureSize(0) == context.textureSize(1)) {
+        renderStereo(w, context, textures);
+        objectData.endFrame();
+        return;
+    }
     for (int view = 0; view < context.viewCount(); view++) {
+        chunkView++;
         // Get view dimensions
         int width = context.textureSize(view).width();
         int height = context.textureSize(view).height();
 
         // Set up framebuffer object to render into
-        glBindTexture(GL_TEXTURE_2D, _fboDepthTex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height,
-                0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-        glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[view], 0);
+        _fboDepthTex = renderTargets.bind(w->id(), view, width, height, textures[view]);
 
         QMatrix4x4 projectionMatrix;
         QMatrix4x4 viewMatrix;
@@ -273,92 +324,49 @@ void MazeApp::render(QVRWindow*  w ,
         glUseProgram(_prg.programId());
 
         if (w->id() == "debug") {
+            // shows the visibility of the first view rendered
+            kdTree.selectView(0);
             glViewport(0, 0, width, height);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            projectionMatrix.ortho(-40.0f, 40.0f, -40.0f, 40.0f, 0.1f, 100.0f);
+            // fit the whole maze plus a margin
+            float extent = 8.0f;
+            if (kdTree.size() > 0) {
+                const Bounds& maze = kdTree.bounds[kdTree.root()];
+                extent += std::max(std::max(-maze.xMin, maze.xMax), std::max(-maze.yMin, maze.yMax));
+            }
+            projectionMatrix.ortho(-extent, extent, -extent, extent, 0.1f, 100.0f);
             _prg.setUniformValue("projection_matrix", projectionMatrix);
             viewMatrix.lookAt(QVector3D(0.0f, 10.0f, 0.0f), QVector3D(0.0f, 0.0f, 0.0f), QVector3D(-1.0f, 0.0f, 0.0f));
             glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
             glDepthMask(GL_TRUE);
             glEnable(GL_DEPTH_TEST);
             //glEnable(GL_CULL_FACE);
-            inOrder(kdTreeRoot, [&](Node* node) {
-                if (node->renderedThisFrame) {
-                    // immediately render
-                    auto cell = node->data.type;
-                    float x = node->data.position.x;
-                    float y = node->data.position.y;
-                    QMatrix4x4 modelMatrix;
-                    modelMatrix.translate(x, 1.0f, y);
-                    QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-                    _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                    _prg.setUniformValue("view_matrix", viewMatrix);
-                    _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-
-                    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                    glDepthMask(GL_TRUE);
-                    //glEnable(GL_DEPTH_TEST);
-                    if (cell == GridCell::WALL) {
-                        _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                        glBindVertexArray(_vaoWall);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                    } else if (cell == GridCell::EMPTY) {
-                        _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                        glBindVertexArray(_vaoFloor);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                    } else if (cell == GridCell::FINISH) {
-                        _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                        glBindVertexArray(_vaoFloor);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                    } else if (cell == GridCell::SPAWN) {
-                        _prg.setUniformValue("color", QVector3D(0.7f, 0.7f, 0.0f));
-                        glBindVertexArray(_vaoFloor);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                    } else if (cell == GridCell::COIN) {
-                        _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                        glBindVertexArray(_vaoFloor);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                        modelMatrix.setToIdentity();
-                        modelMatrix.translate(x, 1.0f, y);
-                        modelMatrix.scale(2.0f);
-                        modelViewMatrix = viewMatrix * modelMatrix;
-                        _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                        _prg.setUniformValue("view_matrix", viewMatrix);
-                        _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                        _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 0.0f));
-                        glBindVertexArray(_vaoCoin);
-                        glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
-                    } else if (cell == GridCell::DOOR) {
-                        _prg.setUniformValue("color", QVector3D(0.0f, 0.0f, 1.0f));
-                        glBindVertexArray(_vaoWall);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                    }
+            setViewData(projectionMatrix, viewMatrix);
+            inOrder(kdTree, kdTree.root(), [&](int node) {
+                if (kdTree.rendered(node)) {
+                    drawObject(kdTree.object(node));
                 }
 
-                if (chcDebug && node->depth == debugLevel && node->visible) {
+                if (chcDebug && kdTree.depths[node] == debugLevel && kdTree.visible(node)) {
                     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                    const Bounds& bounds = kdTree.bounds[node];
                     QMatrix4x4 modelMatrix;
-                    if (!node->isLeaf) {
-                        float scaleX = (node->xMax - node->xMin) / 2.0f;
-                        float scaleY = (node->yMax - node->yMin) / 2.0f;
-                        modelMatrix.translate(node->centerX, 10.0f, node->centerY);
-                        modelMatrix.scale(scaleX, 1.0f, scaleY);
-                    } else {
-                        float x = node->data.position.x;
-                        float y = node->data.position.y;
-                        modelMatrix.translate(x, 10.0f, y);
-                    }
+                    modelMatrix.translate((bounds.xMin + bounds.xMax) / 2.0f, 10.0f, (bounds.yMin + bounds.yMax) / 2.0f);
+                    modelMatrix.scale((bounds.xMax - bounds.xMin) / 2.0f, 1.0f, (bounds.yMax - bounds.yMin) / 2.0f);
                     QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
                     _prg.setUniformValue("projection_matrix", projectionMatrix);
                     _prg.setUniformValue("modelview_matrix", modelViewMatrix);
                     _prg.setUniformValue("view_matrix", viewMatrix);
                     _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
                     _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                    glBindVertexArray(_vaoWall);
-                    glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
+                    glBindVertexArray(_vao);
+                    glDrawElementsBaseVertex(GL_TRIANGLES, _meshWall.indexCount, GL_UNSIGNED_INT,
+                            (void*)(_meshWall.firstIndex * sizeof(GLuint)), _meshWall.baseVertex);
                     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
                 }
             });
+            flushInstances();
+            drawCoins();
 
             // Render player dot
             
@@ -370,576 +378,1130 @@ void MazeApp::render(QVRWindow*  w ,
             _prg.setUniformValue("view_matrix", viewMatrix);
             _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
             _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 1.0f));
-            glBindVertexArray(_vaoCoin);
-            glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
+            glBindVertexArray(_vao);
+            glDrawElementsBaseVertex(GL_TRIANGLES, _meshCoin.indexCount, GL_UNSIGNED_INT,
+                    (void*)(_meshCoin.firstIndex * sizeof(GLuint)), _meshCoin.baseVertex);
         } else {
             projectionMatrix = context.frustum(view).toMatrix4x4();
-            _prg.setUniformValue("projection_matrix", projectionMatrix);
             viewMatrix = context.viewMatrix(view);
-
-            inOrder(kdTreeRoot, [](Node* node) {
-                node->renderedThisFrame = false;
-            });
-
-            // check visible nodes of last frame
-            for (int i = 0; i < vQueries.size(); i++) {
-                while (!vQueries.at(i)->isAvailable()) {
-
+            setViewData(projectionMatrix, viewMatrix);
+
+            kdTree.setFlagAll(KdTree::RENDERED, false);
+            selectChcView(w->id(), view);
+            ChcView& state = chcViews[chcView];
+
+            // check visible nodes of previous frames of this view, oldest frame first
+            for (int i = 1; i <= queryFrames; i++) {
+                std::vector<OcclusionQuery>& queries = state.queries[(state.queryFrame + i) % queryFrames];
+                size_t done = 0;
+                for (; done < queries.size(); done++) {
+                    // results still in flight keep the visibility the node had when it was queried;
+                    // otherwise getResult waits for them in the driver
+                    if (nonBlockingReadback && !queryPool.isAvailable(queries.at(done))) {
+                        break;
+                    }
+                    if (queryPool.getResult(queries.at(done))) {
+                        kdTree.setVisible(queries.at(done).node, true);
+                        shareVisibility(queries.at(done).node);
+                    } else {
+                        kdTree.setVisible(queries.at(done).node, false);
+                        pullUp(kdTree, queries.at(done).node);
+                    }
+                    queryPool.release(queries.at(done));
                 }
-                if (vQueries.at(i)->getResult()) {
-                    vQueries.at(i)->getNode()->visible = true;
-                } else {
-                    vQueries.at(i)->getNode()->visible = false;
-                    pullUp(vQueries.at(i)->getNode());
-                    inOrder(vQueries.at(i)->getNode(), [](Node* node) {
-                        //node->visible = false;
-                    });
+                queries.erase(queries.begin(), queries.begin() + done);
+                if (!queries.empty()) {
+                    // queries finish in order, so newer frames cannot have results yet
+                    break;
                 }
-                delete vQueries.at(i);
             }
-            vQueries.clear();
+            state.queryFrame = (state.queryFrame + 1) % queryFrames;
+            // the GPU is more than queryFrames behind, drop the oldest results
+            for (const auto& query : state.queries[state.queryFrame]) {
+                queryPool.release(query);
+            }
+            state.queries[state.queryFrame].clear();
 
             glViewport(0, 0, width, height);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             
             // frustum culling
-            const QVRFrustum& frustum = context.frustum(view);
-            QVector3D nTop = QVector3D(0.0f, frustum.nearPlane(), frustum.topPlane()).normalized();
-            QVector3D nBottom = -QVector3D(0.0f, frustum.nearPlane(), frustum.bottomPlane()).normalized();
-            QVector3D nRight = QVector3D(frustum.nearPlane(), 0.0f, frustum.rightPlane()).normalized();
-            QVector3D nLeft = -QVector3D(frustum.nearPlane(), 0.0f, frustum.leftPlane()).normalized();
-            if (frustumCulling) {
-                inOrder(kdTreeRoot, [&](Node* root) {
-                    if (root->isLeaf) {
-                        float x = root->data.position.x;
-                        float y = root->data.position.y;
-                        QMatrix4x4 modelMatrix;
-                        modelMatrix.translate(x, 1.0f, y);
-                        QVector3D boundingSphereCenter = (viewMatrix * modelMatrix).column(3).toVector3D();
-                        const float boundingSphereRadius = 2.0f;
-                        if (boundingSphereCenter.z() > (-frustum.nearPlane() + boundingSphereRadius)) {
-                            root->visible = false;
-                        } else if (boundingSphereCenter.z() < (-frustum.farPlane() + boundingSphereRadius)) {
-                            root->visible = false;
-                        } else if (QVector3D::dotProduct(nTop, boundingSphereCenter) > boundingSphereRadius) {
-                            root->visible = false;
-                        } else if (QVector3D::dotProduct(nBottom, boundingSphereCenter) > boundingSphereRadius) {
-                            root->visible = false;
-                        } else if (QVector3D::dotProduct(nLeft, boundingSphereCenter) > boundingSphereRadius) {
-                            root->visible = false;
-                        } else if (QVector3D::dotProduct(nRight, boundingSphereCenter) > boundingSphereRadius) {
-                            root->visible = false;
-                        } else {
-                            root->visible = true;
-                        }
-                    }
-                });
+            // the GPU, PVS and portal modes test single cells instead of the tree
+            if (frustumCulling && occlusionMode != OcclusionMode::GPU && occlusionMode != OcclusionMode::PVS
+                    && occlusionMode != OcclusionMode::PORTALS) {
+                QVector4D planes[6];
+                frustumPlanes(projectionMatrix * viewMatrix, planes);
+                frustumCull(kdTree, kdTree.root(), planes);
             }
-            if (occlusionCullingCHC) {
+            if (occlusionMode == OcclusionMode::GPU) {
+                gpuCulling.cull(chcView, projectionMatrix, viewMatrix, frustumCulling, depthPyramid);
+                gpuCulling.draw(coinTime);
+                // the next frame tests its cells against this depth
+                depthPyramid.build(chcView, _fboDepthTex, width, height, projectionMatrix * viewMatrix);
+            } else if (occlusionMode == OcclusionMode::HIZ) {
+                renderHiZ(width, height, projectionMatrix, viewMatrix, eye);
+            } else if (occlusionMode == OcclusionMode::SOFTWARE) {
+                renderSoftwareOcclusion((float)width / height, projectionMatrix, viewMatrix, eye);
+            } else if (occlusionMode == OcclusionMode::PVS) {
+                renderPvs(projectionMatrix, viewMatrix, eye);
+            } else if (occlusionMode == OcclusionMode::PORTALS) {
+                renderPortals(projectionMatrix, viewMatrix, eye);
+            } else if (occlusionMode == OcclusionMode::CHCPP) {
+                renderCHCPlusPlus(projectionMatrix, viewMatrix, eye);
+            } else if (occlusionMode == OcclusionMode::CHC) {
                 // occlusion culling
-                frontToBack(kdTreeRoot, eye, [&](Node* node) {
-                    if (node->visible && !node->isLeaf) {
+                frontToBack(kdTree, eye, [&](int node) {
+                    if (frustumCulling && !kdTree.inFrustum(node)) {
+                        return true;
+                    }
+                    if (kdTree.visible(node) && !kdTree.isLeaf(node)) {
                         return false;
                     }
-                    if (node->visible && node->isLeaf) {
-                        OcclusionQuery* query = new OcclusionQuery(node);
-                        query->start(projectionMatrix, viewMatrix);
-                        vQueries.push_back(query);
+                    if (kdTree.visible(node) && kdTree.isLeaf(node)) {
+                        OcclusionQuery query = queryPool.acquire(node, chcView);
+                        queryPool.start(query, kdTree.bounds[node], projectionMatrix, viewMatrix);
+                        state.queries[state.queryFrame].push_back(query);
 
                         // immediately render
-                        auto cell = node->data.type;
-                        float x = node->data.position.x;
-                        float y = node->data.position.y;
-                        QMatrix4x4 modelMatrix;
-                        modelMatrix.translate(x, 1.0f, y);
-                        QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-                        _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                        _prg.setUniformValue("view_matrix", viewMatrix);
-                        _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-
-                        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glDepthMask(GL_TRUE);
-                        glEnable(GL_DEPTH_TEST);
-                        //glEnable(GL_CULL_FACE);
-                        if (cell == GridCell::WALL) {
-                            _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                            glBindVertexArray(_vaoWall);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                        } else if (cell == GridCell::EMPTY) {
-                            _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                            glBindVertexArray(_vaoFloor);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                        } else if (cell == GridCell::FINISH) {
-                            _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                            glBindVertexArray(_vaoFloor);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                        } else if (cell == GridCell::SPAWN) {
-                            _prg.setUniformValue("color", QVector3D(0.7f, 0.7f, 0.0f));
-                            glBindVertexArray(_vaoFloor);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                        } else if (cell == GridCell::COIN) {
-                            _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                            glBindVertexArray(_vaoFloor);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            modelMatrix.setToIdentity();
-                            modelMatrix.translate(x, 1.0f, y);
-                            modelMatrix.rotate(90.0f, 1.0f, 0.0f, 0.0f);
-                            modelMatrix.rotate(coinRotation, 0.0f, 0.0f, 1.0f);
-                            modelMatrix.scale(2.0f);
-                            modelViewMatrix = viewMatrix * modelMatrix;
-                            _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                            _prg.setUniformValue("view_matrix", viewMatrix);
-                            _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                            _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 0.0f));
-                            glBindVertexArray(_vaoCoin);
-                            glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
-                        } else if (cell == GridCell::DOOR) {
-                            _prg.setUniformValue("color", QVector3D(0.0f, 0.0f, 1.0f));
-                            glBindVertexArray(_vaoWall);
-                            glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                        }
-                        node->renderedThisFrame = true;
+                        drawObject(kdTree.object(node));
+                        kdTree.setRendered(node, true);
                         return true;
                     }
-                    if (!node->visible) {
-                        OcclusionQuery* query = new OcclusionQuery(node);
-                        query->start(projectionMatrix, viewMatrix);
+                    if (!kdTree.visible(node)) {
+                        flushInstances();
+                        OcclusionQuery query = queryPool.acquire(node, chcView);
+                        queryPool.start(query, kdTree.bounds[node], projectionMatrix, viewMatrix);
                         iQueries.push_back(query);
                         return true;
                     }
                     return false;
                 });
 
+                bool stalled = false;   // the last pass found no result, so wait for the oldest one
                 while (!iQueries.empty()) {
-                    std::vector<OcclusionQuery*> newQueries;
+                    std::vector<OcclusionQuery> newQueries;
+                    size_t pending = iQueries.size();
                     for (auto it = iQueries.begin(); it < iQueries.end();) {
-                        if ((*it)->isAvailable()) { // available?
-                            if ((*it)->getResult()) {   // visible?
-                                if ((*it)->getNode()->isLeaf) {
-                                    Node* node = (*it)->getNode();
-                                    auto cell = node->data.type;
-                                    float x = node->data.position.x;
-                                    float y = node->data.position.y;
-                                    QMatrix4x4 modelMatrix;
-                                    modelMatrix.translate(x, 1.0f, y);
-                                    QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-                                    _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                                    _prg.setUniformValue("view_matrix", viewMatrix);
-                                    _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-
-                                    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                                    glDepthMask(GL_TRUE);
-                                    glEnable(GL_DEPTH_TEST);
-                                    //glEnable(GL_CULL_FACE);
-                                    if (cell == GridCell::WALL) {
-                                        _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                                        glBindVertexArray(_vaoWall);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                                    } else if (cell == GridCell::EMPTY) {
-                                        _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                        glBindVertexArray(_vaoFloor);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                    } else if (cell == GridCell::FINISH) {
-                                        _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                                        glBindVertexArray(_vaoFloor);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                    } else if (cell == GridCell::SPAWN) {
-                                        _prg.setUniformValue("color", QVector3D(0.7f, 0.7f, 0.0f));
-                                        glBindVertexArray(_vaoFloor);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                    } else if (cell == GridCell::COIN) {
-                                        _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                        glBindVertexArray(_vaoFloor);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                        modelMatrix.setToIdentity();
-                                        modelMatrix.translate(x, 1.0f, y);
-                                        modelMatrix.rotate(90.0f, 1.0f, 0.0f, 0.0f);
-                                        modelMatrix.rotate(coinRotation, 0.0f, 0.0f, 1.0f);
-                                        modelMatrix.scale(2.0f);
-                                        modelViewMatrix = viewMatrix * modelMatrix;
-                                        _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                                        _prg.setUniformValue("view_matrix", viewMatrix);
-                                        _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                                        _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 0.0f));
-                                        glBindVertexArray(_vaoCoin);
-                                        glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
-                                    } else if (cell == GridCell::DOOR) {
-                                        _prg.setUniformValue("color", QVector3D(0.0f, 0.0f, 1.0f));
-                                        glBindVertexArray(_vaoWall);
-                                        glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                                    }
-                                    node->renderedThisFrame = true;
-                                    (*it)->getNode()->visible = true;
+                        if ((stalled && it == iQueries.begin()) || queryPool.isAvailable(*it)) { // available?
+                            if (queryPool.getResult(*it)) {   // visible?
+                                int node = it->node;
+                                if (kdTree.isLeaf(node)) {
+                                    drawObject(kdTree.object(node));
+                                    kdTree.setRendered(node, true);
+                                    kdTree.setVisible(node, true);
+                                    shareVisibility(node);
                                 } else {
-                                    Node* node =(*it)->getNode();
-                                    OcclusionQuery* queryLeft = new OcclusionQuery(node->left);
-                                    OcclusionQuery* queryRight = new OcclusionQuery(node->right);
-                                    node->visible = true;
-                                    queryLeft->start(projectionMatrix, viewMatrix);
-                                    queryRight->start(projectionMatrix, viewMatrix);
-                                    newQueries.push_back(queryLeft);
-                                    newQueries.push_back(queryRight);
+                                    flushInstances();
+                                    kdTree.setVisible(node, true);
+                                    for (int child : { kdTree.left(node), kdTree.right(node) }) {
+                                        if (frustumCulling && !kdTree.inFrustum(child)) {
+                                            continue;
+                                        }
+                                        OcclusionQuery query = queryPool.acquire(child, chcView);
+                                        queryPool.start(query, kdTree.bounds[child], projectionMatrix, viewMatrix);
+                                        newQueries.push_back(query);
+                                    }
                                 }
 
                             } else {    // not visible
-                                Node* node = (*it)->getNode();
-                                node->visible = false;
-                                pullUp(node);
-                                inOrder(node, [](Node* node) {
-                                    node->visible = false;
+                                int node = it->node;
+                                kdTree.setVisible(node, false);
+                                pullUp(kdTree, node);
+                                inOrder(kdTree, node, [&](int child) {
+                                    kdTree.setVisible(child, false);
                                 });
                             }
-                            delete (*it);
+                            queryPool.release(*it);
                             it = iQueries.erase(it);
                         } else {    // not available yet
                             it++;
                         }
                     }   // end query loop
+                    stalled = (iQueries.size() == pending);
                     iQueries.insert(iQueries.end(), newQueries.begin(), newQueries.end());
                 }   // end not empty while loop
-            } else if (occlusionCulling) {
-                frontToBack(kdTreeRoot, eye, [&](Node* node) {
-                    if (node->isLeaf) {
-                        GLuint query;
-                        glGenQueries(1, &query);
-                        glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
-                        auto cell = node->data.type;
-                        float x = node->data.position.x;
-                        float y = node->data.position.y;
-                        
-                        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                        glDepthMask(GL_FALSE);
-                        //glEnable(GL_CULL_FACE);
-                        QMatrix4x4 modelMatrix;
-                        modelMatrix.translate(x, 1.0f, y);
-                        QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-                        _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                        _prg.setUniformValue("view_matrix", viewMatrix);
-                        _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                        _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                        glBindVertexArray(_vaoWall);
-                        glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                        glEndQuery(GL_ANY_SAMPLES_PASSED);
-
-                        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glDepthMask(GL_TRUE);
-
-                        GLuint available;
-                        do {
-                            glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
-                        } while (available != GL_TRUE);
-                        GLuint visible;
-                        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &visible);
-                        glDeleteQueries(1, &query);
-                        if (visible == GL_TRUE) {
-                            node->renderedThisFrame = true;
-                            if (cell == GridCell::WALL) {
-                                _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                                glBindVertexArray(_vaoWall);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::EMPTY) {
-                                _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::FINISH) {
-                                _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::SPAWN) {
-                                _prg.setUniformValue("color", QVector3D(0.7f, 0.7f, 0.0f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::COIN) {
-                                _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                modelMatrix.setToIdentity();
-                                modelMatrix.translate(x, 1.0f, y);
-                                modelMatrix.rotate(90.0f, 1.0f, 0.0f, 0.0f);
-                                modelMatrix.rotate(coinRotation, 0.0f, 0.0f, 1.0f);
-                                modelMatrix.scale(2.0f);
-                                modelViewMatrix = viewMatrix * modelMatrix;
-                                _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                                _prg.setUniformValue("view_matrix", viewMatrix);
-                                _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                                _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 0.0f));
-                                glBindVertexArray(_vaoCoin);
-                                glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::DOOR) {
-                                _prg.setUniformValue("color", QVector3D(0.0f, 0.0f, 1.0f));
-                                glBindVertexArray(_vaoWall);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                            }
+            } else if (occlusionMode == OcclusionMode::QUERIES) {
+                frontToBack(kdTree, eye, [&](int node) {
+                    if (frustumCulling && !kdTree.inFrustum(node)) {
+                        return true;
+                    }
+                    if (kdTree.isLeaf(node)) {
+                        if (pendingInstances() >= instanceBatchSize) {
+                            flushInstances();
+                        }
+                        OcclusionQuery query = queryPool.acquire(node, chcView);
+                        queryPool.start(query, kdTree.bounds[node], projectionMatrix, viewMatrix);
+
+                        // waits for the result in the driver
+                        bool visible = queryPool.getResult(query);
+                        queryPool.release(query);
+                        if (visible) {
+                            kdTree.setRendered(node, true);
+                            drawObject(kdTree.object(node));
                         }
                     }
                     return false;
                 });
             } else {
-                frontToBack(kdTreeRoot, eye, [&](Node* root){
-                    if (root->isLeaf) {
-                        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glDepthMask(GL_TRUE);
-                        glEnable(GL_DEPTH_TEST);
-                        //glEnable(GL_CULL_FACE);
-                        auto cell = root->data.type;
-                        float x = root->data.position.x;
-                        float y = root->data.position.y;
-                        if (root->visible) {
-                            QMatrix4x4 modelMatrix;
-                            modelMatrix.translate(x, 1.0f, y);
-                            QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-                            _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                            _prg.setUniformValue("view_matrix", viewMatrix);
-                            _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                            root->renderedThisFrame = true;
-                            if (cell == GridCell::WALL) {
-                                _prg.setUniformValue("color", QVector3D(1.0f, 0.0f, 0.0f));
-                                glBindVertexArray(_vaoWall);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::EMPTY) {
-                                _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::FINISH) {
-                                _prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::SPAWN) {
-                                _prg.setUniformValue("color", QVector3D(0.7f, 0.7f, 0.0f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                
-                            } else if (cell == GridCell::COIN) {
-                                _prg.setUniformValue("color", QVector3D(0.5f, 0.5f, 0.5f));
-                                glBindVertexArray(_vaoFloor);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesFloor, GL_UNSIGNED_INT, 0);
-                                modelMatrix.setToIdentity();
-                                modelMatrix.translate(x, 1.0f, y);
-                                modelMatrix.rotate(90.0f, 1.0f, 0.0f, 0.0f);
-                                modelMatrix.rotate(coinRotation, 0.0f, 0.0f, 1.0f);
-                                modelMatrix.scale(2.0f);
-                                modelViewMatrix = viewMatrix * modelMatrix;
-                                _prg.setUniformValue("modelview_matrix", modelViewMatrix);
-                                _prg.setUniformValue("view_matrix", viewMatrix);
-                                _prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-                                _prg.setUniformValue("color", QVector3D(1.0f, 1.0f, 0.0f));
-                                glBindVertexArray(_vaoCoin);
-                                glDrawElements(GL_TRIANGLES, _coinSize, GL_UNSIGNED_INT, 0);
-                            } else if (cell == GridCell::DOOR) {
-                                _prg.setUniformValue("color", QVector3D(0.0f, 0.0f, 1.0f));
-                                glBindVertexArray(_vaoWall);
-                                glDrawElements(GL_TRIANGLES, _vaoIndicesWall, GL_UNSIGNED_INT, 0);
-                            }
-                        }
+                frontToBack(kdTree, eye, [&](int node){
+                    if (frustumCulling && !kdTree.inFrustum(node)) {
+                        return true;
+                    }
+                    if (kdTree.isLeaf(node)) {
+                        kdTree.setRendered(node, true);
+                        drawObject(kdTree.object(node));
                     }
                     return false;
                 });
             }
+
+            flushInstances();
+            // the GPU mode culls and draws the coins with their cells
+            if (occlusionMode != OcclusionMode::GPU) {
+                drawCoins();
+            }
         }
         
     }
+    objectData.endFrame();
 }
 
-void MazeApp::update(const QList<QVRObserver*>& observers)
+void MazeApp::renderStereo(QVRWindow* w, const QVRRenderContext& context, const unsigned int* textures)
 {
-    float runSpeed = 5.0f;
-    constexpr float hitbox = 0.1f;  // you are a 20 cm wide cylinder
-    constexpr float collectionRange = 0.3f;
-    constexpr float sensitivity = 0.5f; // mouse sensitivity
-    constexpr float wallRadius = 1.0f;
-    constexpr float coinSpeed = 100.0f;
-    static float timeInWall = 0.0f;
-    float seconds = 0.0f;
-    if (_timer.isValid()) {
-        seconds = _timer.nsecsElapsed() / 1e9f;
-        _timer.restart();
-    } else {
-        _timer.start();
+    chunkView++;
+    int width = context.textureSize(0).width();
+    int height = context.textureSize(0).height();
+    renderTargets.bindStereo(w->id(), width, height);
+
+    StereoViewData viewData;
+    QVector4D planes[12];
+    for (int view = 0; view < 2; view++) {
+        QMatrix4x4 projectionMatrix = context.frustum(view).toMatrix4x4();
+        QMatrix4x4 viewMatrix = context.viewMatrix(view);
+        std::copy(projectionMatrix.constData(), projectionMatrix.constData() + 16, viewData.projectionMatrices[view]);
+        std::copy(viewMatrix.constData(), viewMatrix.constData() + 16, viewData.viewMatrices[view]);
+        frustumPlanes(projectionMatrix * viewMatrix, planes + 6 * view);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, _stereoViewUniformBuf);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(StereoViewData), &viewData);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 3, _stereoViewUniformBuf);
+    // the eyes are a few centimeters apart, so the order from between them suits both
+    QVector3D eye = context.navigationPosition()
+        + (context.trackingPosition(0) + context.trackingPosition(1)) / 2.0f;
+
+    kdTree.setFlagAll(KdTree::RENDERED, false);
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (frustumCulling) {
+        frustumCullStereo(kdTree, kdTree.root(), planes);
     }
-    coinRotation += seconds * coinSpeed;
 
-    auto deviceCount = QVRManager::deviceCount();
-    auto observer = observers.at(0);    // only support one observer
-	if (observer->config().trackingType() == QVRTrackingType::QVR_Tracking_Device) {
-		runSpeed = 2.0f;
-	}
+    // every flushed object is drawn once per eye, into the layer of the eye
+    instanceViews = 2;
+    objectData.setInstanceViews(instanceViews);
+    frontToBack(kdTree, eye, [&](int node){
+        if (frustumCulling && !kdTree.inFrustum(node)) {
+            return true;
+        }
+        if (kdTree.isLeaf(node)) {
+            kdTree.setRendered(node, true);
+            drawObject(kdTree.object(node));
+        }
+        return false;
+    });
+    flushInstances();
+    drawCoins();
+    instanceViews = 1;
+    objectData.setInstanceViews(instanceViews);
 
-    if (observer->config().navigationType() == QVRNavigationType::QVR_Navigation_Custom) {
-        QVector3D posUpdate;
-        auto orientation = observer->trackingOrientation();
-		if (observer->config().trackingType() == QVRTrackingType::QVR_Tracking_Stationary) {
-			orientation = observer->navigationOrientation();
-		}
+    renderTargets.resolveStereo(w->id(), textures);
+}
 
-        float pitch, yaw, roll;
-        orientation.getEulerAngles(&pitch, &yaw, &roll);
-        QVector3D forward = QQuaternion::fromEulerAngles(0, yaw, roll) * QVector3D(0.0f, 0.0f, -1.0f);
-        QVector3D right = QQuaternion::fromEulerAngles(0, yaw, roll) * QVector3D(1.0f, 0.0f, 0.0f);
+void MazeApp::setViewData(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix)
+{
+    ViewData viewData;
+    std::copy(projectionMatrix.constData(), projectionMatrix.constData() + 16, viewData.projectionMatrix);
+    std::copy(viewMatrix.constData(), viewMatrix.constData() + 16, viewData.viewMatrix);
+    glBindBuffer(GL_UNIFORM_BUFFER, _viewUniformBuf);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ViewData), &viewData);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, _viewUniformBuf);
+}
 
-        if (forwardPressed) {
-            posUpdate += runSpeed * seconds * forward;
-        }
-        if (backwardPressed) {
-            posUpdate -= runSpeed * seconds * forward;
-        }
-        if (rightPressed) {
-            posUpdate += runSpeed * seconds * right;
-        }
-        if (leftPressed) {
-            posUpdate -= runSpeed * seconds * right;
-        }
-        
-        yaw += mouseDx.x()*sensitivity;
-        pitch += mouseDx.y()*sensitivity;
-        if (pitch > 89.0f) {
-            pitch = 89.0f;
-        }
-        if (pitch < -89.0f) {
-            pitch = -89.0f;
-        }
-        auto newOrientation = QQuaternion::fromEulerAngles(pitch, yaw, roll);
+static ObjectData makeObjectData(const QMatrix4x4& modelMatrix, const QVector3D& color)
+{
+    ObjectData data;
+    std::copy(modelMatrix.constData(), modelMatrix.constData() + 16, data.modelMatrix);
+    data.color[0] = color.x();
+    data.color[1] = color.y();
+    data.color[2] = color.z();
+    data.color[3] = 1.0f;
+    return data;
+}
 
-		if (observer->config().trackingType() != QVR_Tracking_Stationary) {
-			newOrientation = observer->navigationOrientation();
-		}
+// color of the walls or the floor of a cell
+static QVector3D cellColor(GridCell cell)
+{
+    switch (cell) {
+    case GridCell::WALL:    return QVector3D(1.0f, 0.0f, 0.0f);
+    case GridCell::FINISH:  return QVector3D(0.0f, 1.0f, 0.0f);
+    case GridCell::SPAWN:   return QVector3D(0.7f, 0.7f, 0.0f);
+    case GridCell::DOOR:    return QVector3D(0.0f, 0.0f, 1.0f);
+    default:                return QVector3D(0.5f, 0.5f, 0.5f);
+    }
+}
 
-        auto navigationPosition = observer->navigationPosition();
-        auto position = navigationPosition + observer->trackingPosition();
-        bool collision = false;
-        position += posUpdate;
-        navigationPosition += posUpdate;
-        frontToBack(kdTreeRoot, position, [&](Node* node) {
-            if (!node->isLeaf) return false;
-            auto& object = node->data;
-            if (object.type == GridCell::WALL || object.type == GridCell::DOOR || object.type == GridCell::FINISH) {
-                auto wallCenter = object.position;
-                auto circleDistanceX = std::abs(position.x() - wallCenter.x);
-                auto circleDistanceY = std::abs(position.z() - wallCenter.y);
-                if (circleDistanceX > (wallRadius + hitbox)) return false;
-                if (circleDistanceY > (wallRadius + hitbox)) return false;
-                auto cornerDistance_sq = (circleDistanceX - wallRadius)*(circleDistanceX - wallRadius) +
-                    (circleDistanceY - wallRadius)*(circleDistanceY - wallRadius);
-                if (circleDistanceX <= wallRadius || circleDistanceY <= wallRadius ||
-                    cornerDistance_sq <= (hitbox*hitbox)) {
-                    // handle collision
-                    if (object.type == GridCell::FINISH) {
-                        _wantExit = true;
-                        return true;
-                    }
-                    collision = true;
-                    return true;
-                }
-            }
-            if (object.type == GridCell::COIN) {
-                auto coinPos = object.position;
-                auto dist = (coinPos.x - position.x())*(coinPos.x - position.x()) + (coinPos.y - position.z())*(coinPos.y - position.z());
-                if (dist < (coinBoundingSphere + collectionRange) * (coinBoundingSphere + collectionRange)) {
-                    // collect coin
-                    object.type = GridCell::EMPTY;
-                    coinsLeft--;
-                    //for (int i = 0; i < deviceCount; i++) {
-                    //    auto device = QVRManager::device(i);
-                    //    if (device.supportsHapticPulse()) {
-                    //        device.triggerHapticPulse(1000);
-                    //    }
-                    //}
-                }
-            }
-            return false;
-        });
-        if (collision) {
-            observer->setNavigation(observer->navigationPosition(), newOrientation);
-        } else {
-            observer->setNavigation(navigationPosition, newOrientation);
+void MazeApp::drawObject(const RenderObject& object)
+{
+    auto cell = object.type;
+    float x = object.position.x;
+    float y = object.position.y;
+    QMatrix4x4 modelMatrix;
+    modelMatrix.translate(x, 1.0f, y);
+
+    // collect the object, it is drawn by the next flushInstances
+    int chunk = -1;
+    if (mergedGeometry) {
+        chunk = chunkStreamer.chunkOf(std::lround((gridHeight - 1.0f - y) / 2.0f), std::lround((x + gridWidth - 1.0f) / 2.0f));
+    }
+    if (chunk >= 0 && chunkBuffers.resident(chunk)) {
+        // walls and floors are drawn with the chunk of the cell, once per view
+        if (chunkViews[chunk] != chunkView) {
+            chunkViews[chunk] = chunkView;
+            pendingChunks.push_back(chunk);
         }
+    } else if (cell == GridCell::WALL || cell == GridCell::DOOR) {
+        wallInstances.push_back(makeObjectData(modelMatrix, cellColor(cell)));
     } else {
-        auto navigationPosition = observer->navigationPosition();
-        auto position = navigationPosition + observer->trackingPosition();
-        bool collision = false;
-        frontToBack(kdTreeRoot, position, [&](Node* node) {
-            if (!node->isLeaf) return false;
-            auto& object = node->data;
-            if (object.type == GridCell::WALL || object.type == GridCell::DOOR || object.type == GridCell::FINISH) {
-                auto wallCenter = object.position;
-                auto circleDistanceX = std::abs(position.x() - wallCenter.x);
-                auto circleDistanceY = std::abs(position.z() - wallCenter.y);
-                if (circleDistanceX > (wallRadius + hitbox)) return false;
-                if (circleDistanceY > (wallRadius + hitbox)) return false;
-                auto cornerDistance_sq = (circleDistanceX - wallRadius)*(circleDistanceX - wallRadius) +
-                    (circleDistanceY - wallRadius)*(circleDistanceY - wallRadius);
-                if (circleDistanceX <= wallRadius || circleDistanceY <= wallRadius ||
-                    cornerDistance_sq <= (hitbox*hitbox)) {
-                    // handle collision
-                    if (object.type == GridCell::FINISH) {
-                        _wantExit = true;
-                        return true;
-                    }
-                    collision = true;
-                    return true;
-                }
-            }
-            if (object.type == GridCell::COIN) {
-                auto coinPos = object.position;
-                auto dist = (coinPos.x - position.x())*(coinPos.x - position.x()) + (coinPos.y - position.z())*(coinPos.y - position.z());
-                if (dist < (coinBoundingSphere + collectionRange) * (coinBoundingSphere + collectionRange)) {
-                    // collect coin
-                    object.type = GridCell::EMPTY;
-                    coinsLeft--;
-                    //for (int i = 0; i < deviceCount; i++) {
-                    //    auto device = QVRManager::device(i);
-                    //    if (device.supportsHapticPulse()) {
-                    //        device.triggerHapticPulse(1000);
-                    //    }
-                    //}
-                }
-            }
-            return false;
-        });
-        if (collision) {
-            timeInWall += seconds;
-            //for (int i = 0; i < deviceCount; i++) {
-            //    auto device = QVRManager::device(i);
-            //    if (device.supportsHapticPulse()) {
-            //        device.triggerHapticPulse(1000);
-            //    }
-            //}
-        } else {
-            timeInWall = 0.0f;
-        }
+        floorInstances.push_back(makeObjectData(modelMatrix, cellColor(cell)));
+    }
+    // the coin of a coin cell is drawn from the coin buffer, see drawCoins; every drawn object
+    // lies in the kd-tree
+    if (cell == GridCell::COIN) {
+        coinBuffer.addVisible(&object - kdTree.objects.data());
+    }
 
-        if (timeInWall > 1.0f) {
-            _wantExit = true;
-        }
+    if (!instancedRendering) {
+        // one draw call per mesh of every object
+        flushInstances();
     }
+}
 
-    if (coinsLeft == 0) {
-        inOrder(kdTreeRoot, [](Node* node){
-            if (node->isLeaf) {
-                if (node->data.type == GridCell::DOOR) {
-                    node->data.type = GridCell::EMPTY;
-                }
-            }
-        });
+size_t MazeApp::pendingInstances() const
+{
+    return wallInstances.size() + floorInstances.size() + pendingChunks.size();
+}
+
+void MazeApp::flushInstances()
+{
+    if (pendingInstances() == 0) return;
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(instanceViews > 1 ? _prgObjectsStereo.programId() : _prgObjects.programId());
+
+    // One command per mesh, all of them submitted in a single call. Growing the buffers replaces
+    // the command buffer, so it is bound after the reservations.
+    GLsizei meshCount = !wallInstances.empty() + !floorInstances.empty();
+    if (meshCount > 0) {
+        GLuint first;
+        ObjectData* data = objectData.reserve(wallInstances.size() + floorInstances.size(), first);
+        GLintptr offset;
+        DrawElementsIndirectCommand* commands = objectData.reserveCommands(meshCount, offset);
+        GLsizei commandCount = 0;
+        appendInstances(_meshWall, wallInstances, data, first, commands, commandCount);
+        appendInstances(_meshFloor, floorInstances, data, first, commands, commandCount);
+        glBindVertexArray(_vao);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, objectData.commands());
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)offset, commandCount, 0);
     }
 
-    playerPosition = observer->navigationPosition() + observer->trackingPosition();
-    mouseDx = QVector2D(0.0f, 0.0f);
+    // one command per material of every chunk, each with an object that holds its color
+    if (!pendingChunks.empty()) {
+        GLsizei commandCount = 0;
+        for (int chunk : pendingChunks) {
+            for (int material = 0; material < gridCellTypes; material++) {
+                commandCount += chunkBuffers.mesh(chunk, static_cast<GridCell>(material)).indexCount > 0;
+            }
+        }
+        GLuint first;
+        ObjectData* data = objectData.reserve(commandCount, first);
+        GLintptr offset;
+        DrawElementsIndirectCommand* commands = objectData.reserveCommands(commandCount, offset);
+        for (int chunk : pendingChunks) {
+            for (int material = 0; material < gridCellTypes; material++) {
+                Mesh mesh = chunkBuffers.mesh(chunk, static_cast<GridCell>(material));
+                if (mesh.indexCount == 0) continue;
+                *data++ = makeObjectData(QMatrix4x4(), cellColor(static_cast<GridCell>(material)));
+                DrawElementsIndirectCommand& command = *commands++;
+                command.count = mesh.indexCount;
+                command.instanceCount = instanceViews;
+                command.firstIndex = mesh.firstIndex;
+                command.baseVertex = mesh.baseVertex;
+                command.baseInstance = first++;
+            }
+        }
+        pendingChunks.clear();
+        glBindVertexArray(chunkBuffers.vertexArray());
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, objectData.commands());
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)offset, commandCount, 0);
+    }
+    glUseProgram(_prg.programId());
 }
 
-bool MazeApp::wantExit()
+void MazeApp::drawCoins()
 {
-    return _wantExit;
+    // only the coins of the objects drawn since the last call
+    GLsizei visibleCount = coinBuffer.uploadVisible();
+    if (visibleCount == 0) return;
+
+    QOpenGLShaderProgram& prg = (instanceViews > 1 ? _prgCoinsStereo : _prgCoins);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(prg.programId());
+    prg.setUniformValue("time", coinTime);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, coinBuffer.storageBuffer());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, coinBuffer.visibleStorageBuffer());
+    glBindVertexArray(_vao);
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, _meshCoin.indexCount, GL_UNSIGNED_INT,
+            (void*)(_meshCoin.firstIndex * sizeof(GLuint)), visibleCount * instanceViews, _meshCoin.baseVertex);
+    glUseProgram(_prg.programId());
 }
 
-void MazeApp::serializeDynamicData(QDataStream& ds) const
+void MazeApp::appendInstances(const Mesh& mesh, std::vector<ObjectData>& instances, ObjectData*& data, GLuint& first,
+        DrawElementsIndirectCommand* commands, GLsizei& commandCount)
 {
+    if (instances.empty()) return;
+
+    std::copy(instances.begin(), instances.end(), data);
+    DrawElementsIndirectCommand& command = commands[commandCount++];
+    command.count = mesh.indexCount;
+    command.instanceCount = instances.size() * instanceViews;
+    command.firstIndex = mesh.firstIndex;
+    command.baseVertex = mesh.baseVertex;
+    command.baseInstance = first;
+    data += instances.size();
+    first += instances.size();
+    instances.clear();
 }
 
-void MazeApp::deserializeDynamicData(QDataStream& ds)
+void MazeApp::selectChcView(const QString& window, int view)
 {
+    auto found = std::find_if(chcViews.begin(), chcViews.end(),
+            [&](const ChcView& state) { return state.view == view && state.window == window; });
+    if (found == chcViews.end()) {
+        ChcView state;
+        state.window = window;
+        state.view = view;
+        chcViews.push_back(state);
+        found = chcViews.end() - 1;
+    }
+    chcView = found - chcViews.begin();
+    kdTree.selectView(chcView);
 }
 
-void MazeApp::keyPressEvent(const QVRRenderContext& /* context */, QKeyEvent* event)
+void MazeApp::shareVisibility(int node)
+{
+    // A leaf seen by one eye is most likely seen by the other one too; telling it saves the
+    // queries that would find it again. Nodes outside its frustum are skipped there anyway, and
+    // its own visible queries correct the rest. Hidden results are not shared, a node hidden
+    // from one eye may still be seen by the other.
+    for (int other = 0; other < (int)chcViews.size(); other++) {
+        if (other == chcView || chcViews[other].window != chcViews[chcView].window) continue;
+        // the CHC++ traversal of the other view counts a node as visible if it was visible in
+        // its last frame
+        int lastFrame = chcViews[other].frame;
+        for (int n = node; n >= 0; n = kdTree.parent(n)) {
+            NodeHistory& history = kdTree.history(other, n);
+            if (kdTree.visible(other, n) && history.lastVisited == lastFrame) break;
+            kdTree.setVisible(other, n, true);
+            history.lastVisited = lastFrame;
+        }
+    }
+}
+
+void MazeApp::renderCHCPlusPlus(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye)
+{
+    constexpr size_t maxBatchSize = 32;     // previously invisible nodes collected before their queries are issued
+    constexpr size_t visibleBatchSize = 8;  // visible-node queries issued while waiting for a result
+
+    int& chcFrame = chcViews[chcView].frame;
+    chcFrame++;
+
+    if (kdTree.size() == 0) return;
+    chcStack.push_back(kdTree.root());
+    while (!chcStack.empty() || !chcQueryQueue.empty()) {
+        // handle returned queries
+        while (!chcQueryQueue.empty()) {
+            MultiQuery multiQuery = chcQueryQueue.front();
+            if (!queryPool.isAvailable(multiQuery.query)) {
+                if (!chcStack.empty()) {
+                    break;  // keep traversing while the GPU works on the query
+                }
+                // nothing left to traverse, use the wait for queries of visible nodes
+                issueVisibleQueries(projectionMatrix, viewMatrix, visibleBatchSize);
+                continue;
+            }
+            chcQueryQueue.pop_front();
+            bool visible = queryPool.getResult(multiQuery.query);
+            queryPool.release(multiQuery.query);
+            if (visible && multiQuery.count > 1) {
+                // the multiquery failed, query its nodes one by one
+                queryPool.beginBatch(projectionMatrix, viewMatrix);
+                for (size_t i = 0; i < multiQuery.count; i++) {
+                    int node = chcMultiQueryNodes.at(multiQuery.first + i);
+                    MultiQuery single;
+                    single.query = queryPool.acquire(node, chcView);
+                    single.first = multiQuery.first + i;
+                    single.count = 1;
+                    queryPool.beginQuery(single.query);
+                    queryPool.drawProxy(kdTree.bounds[node]);
+                    queryPool.endQuery();
+                    chcQueryQueue.push_back(single);
+                }
+                queryPool.endBatch();
+            } else if (visible) {
+                int node = multiQuery.query.node;
+                kdTree.history(node).invisibleFrames = 0;
+                pullUpVisibility(kdTree, node);
+                if (kdTree.isLeaf(node)) {
+                    shareVisibility(node);
+                }
+                traverseCHCPlusPlus(node, eye);
+            } else {
+                for (size_t i = 0; i < multiQuery.count; i++) {
+                    int node = chcMultiQueryNodes.at(multiQuery.first + i);
+                    kdTree.setVisible(node, false);
+                    kdTree.history(node).invisibleFrames++;
+                }
+            }
+        }
+
+        if (!chcStack.empty()) {
+            int node = chcStack.back();
+            chcStack.pop_back();
+            if (frustumCulling && !kdTree.inFrustum(node)) {
+                // nodes outside the frustum keep their state and are queried when they enter it again
+                continue;
+            }
+            NodeHistory& history = kdTree.history(node);
+            bool wasVisible = kdTree.visible(node) && history.lastVisited == chcFrame - 1;
+            history.lastVisited = chcFrame;
+            if (!wasVisible) {
+                chcInvisibleQueue.push_back(node);
+                if (chcInvisibleQueue.size() >= maxBatchSize) {
+                    issueMultiQueries(projectionMatrix, viewMatrix);
+                }
+            } else {
+                if (kdTree.isLeaf(node) && history.nextQueryFrame <= chcFrame) {
+                    chcVisibleQueue.push_back(node);
+                }
+                traverseCHCPlusPlus(node, eye);
+            }
+        }
+        if (chcStack.empty()) {
+            issueMultiQueries(projectionMatrix, viewMatrix);
+        }
+    }
+    // the results of the remaining visible queries are read back in the next frame
+    issueVisibleQueries(projectionMatrix, viewMatrix, chcVisibleQueue.size());
+    chcMultiQueryNodes.clear();
+}
+
+void MazeApp::renderHiZ(int width, int height, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix,
+        const QVector3D& eye)
+{
+    constexpr int maxDepthSize = 128;   // texels per side of the finest level tested on the CPU
+
+    // Every node is tested against the depth of the previous frame, seen through the camera of
+    // that frame, so a hidden subtree is skipped as a whole. The pyramid was copied to the CPU
+    // behind the draw calls of that frame; until the copy has finished nothing is culled.
+    QMatrix4x4 pyramidMatrix;
+    bool culling = depthPyramid.takeRead(chcView, hiZLevels, pyramidMatrix);
+    frontToBack(kdTree, eye, [&](int node) {
+        if (frustumCulling && !kdTree.inFrustum(node)) {
+            return true;
+        }
+        if (culling && hiZOccluded(kdTree.bounds[node], pyramidMatrix, hiZLevels)) {
+            kdTree.setVisible(node, false);
+            return true;
+        }
+        kdTree.setVisible(node, true);
+        if (kdTree.isLeaf(node)) {
+            kdTree.setRendered(node, true);
+            drawObject(kdTree.object(node));
+        }
+        return false;
+    });
+    flushInstances();
+
+    // the next frame tests its nodes against this depth
+    depthPyramid.build(chcView, _fboDepthTex, width, height, projectionMatrix * viewMatrix);
+    depthPyramid.requestRead(chcView, maxDepthSize);
+}
+
+void MazeApp::renderSoftwareOcclusion(float aspect, const QMatrix4x4& projectionMatrix,
+        const QMatrix4x4& viewMatrix, const QVector3D& eye)
+{
+    constexpr int occluderRange = 12;   // cells around the eye whose walls are rasterized
+
+    // the walls were rasterized with the camera of this window view in the last frame while
+    // update() ran
+    while (rasterizers.size() < chcViews.size()) {
+        rasterizers.emplace_back();
+    }
+    OcclusionRasterizer& rasterizer = rasterizers[chcView];
+    bool culling = rasterizer.finish();
+    frontToBack(kdTree, eye, [&](int node) {
+        if (frustumCulling && !kdTree.inFrustum(node)) {
+            return true;
+        }
+        if (culling && rasterizer.occluded(kdTree.bounds[node])) {
+            kdTree.setVisible(node, false);
+            return true;
+        }
+        kdTree.setVisible(node, true);
+        if (kdTree.isLeaf(node)) {
+            kdTree.setRendered(node, true);
+            drawObject(kdTree.object(node));
+        }
+        return false;
+    });
+
+    // Walls and closed doors near the eye occlude the most. Only pixels covered by a single box
+    // are written, so runs of them along the rows, and along the columns for the rest, become
+    // one box each instead of boxes with seams in between.
+    int eyeRow = std::floor((gridHeight - eye.z()) / 2.0f);
+    int eyeCol = std::floor((eye.x() + gridWidth) / 2.0f);
+    int rowMin = std::max(eyeRow - occluderRange, 0);
+    int rowMax = std::min(eyeRow + occluderRange, (int)gridHeight - 1);
+    int colMin = std::max(eyeCol - occluderRange, 0);
+    int colMax = std::min(eyeCol + occluderRange, (int)gridWidth - 1);
+    occluderBoxes.clear();
+    if (rowMin > rowMax || colMin > colMax) {
+        rasterizer.start(occluderBoxes, projectionMatrix * viewMatrix, aspect);
+        return;
+    }
+    int cols = colMax - colMin + 1;
+    occluderCells.assign((rowMax - rowMin + 1) * cols, false);
+    auto occluder = [&](int row, int col) {
+        GridCell type = kdTree.objects[cellObjects[row * gridWidth + col]].type;
+        return (type == GridCell::WALL || type == GridCell::DOOR) && !occluderCells[(row - rowMin) * cols + col - colMin];
+    };
+    auto addRun = [&](int row0, int col0, int row1, int col1) {
+        Bounds box = objectBounds(kdTree.objects[cellObjects[row0 * gridWidth + col0]]);
+        Bounds last = objectBounds(kdTree.objects[cellObjects[row1 * gridWidth + col1]]);
+        box.xMin = std::min(box.xMin, last.xMin);
+        box.xMax = std::max(box.xMax, last.xMax);
+        box.yMin = std::min(box.yMin, last.yMin);
+        box.yMax = std::max(box.yMax, last.yMax);
+        occluderBoxes.push_back(box);
+        for (int row = row0; row <= row1; row++) {
+            for (int col = col0; col <= col1; col++) {
+                occluderCells[(row - rowMin) * cols + col - colMin] = true;
+            }
+        }
+    };
+    for (int row = rowMin; row <= rowMax; row++) {
+        for (int col = colMin; col <= colMax; col++) {
+            int last = col;
+            while (occluder(row, col) && last + 1 <= colMax && occluder(row, last + 1)) {
+                last++;
+            }
+            if (last > col) {
+                addRun(row, col, row, last);
+                col = last;
+            }
+        }
+    }
+    for (int col = colMin; col <= colMax; col++) {
+        for (int row = rowMin; row <= rowMax; row++) {
+            if (!occluder(row, col)) continue;
+            int last = row;
+            while (last + 1 <= rowMax && occluder(last + 1, col)) {
+                last++;
+            }
+            addRun(row, col, last, col);
+            row = last;
+        }
+    }
+    rasterizer.start(occluderBoxes, projectionMatrix * viewMatrix, aspect);
+}
+
+void MazeApp::renderPvs(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye)
+{
+    QVector4D planes[6];
+    frustumPlanes(projectionMatrix * viewMatrix, planes);
+    auto draw = [&](int object) {
+        const RenderObject& renderObject = kdTree.objects[object];
+        if (frustumCulling && !intersectsFrustum(objectBounds(renderObject), planes)) return;
+        kdTree.setRendered(world.leaf(object), true);
+        drawObject(renderObject);
+    };
+
+    int row = std::floor((gridHeight - eye.z()) / 2.0f);
+    int col = std::floor((eye.x() + gridWidth) / 2.0f);
+    // walls only hide what lies behind them for an eye below their top, as in renderPortals
+    if (eye.y() <= 0.0f || eye.y() >= cellHeight || !pvs.covers(row, col)) {
+        // the eye is above the walls, inside a wall or outside the maze
+        for (int object = 0; object < (int)kdTree.objects.size(); object++) {
+            draw(object);
+        }
+        return;
+    }
+    // doors are portals: once one of them opened, the cells behind all doors count
+    bool doorsOpen = world.count(GridCell::DOOR) < pvs.doorCount();
+    pvs.forEachVisible(row, col, doorsOpen, [&](int visibleRow, int visibleCol) {
+        draw(cellObjects[visibleRow * gridWidth + visibleCol]);
+    });
+}
+
+void MazeApp::renderPortals(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye)
+{
+    QVector4D planes[6];
+    frustumPlanes(projectionMatrix * viewMatrix, planes);
+    auto draw = [&](int object) {
+        const RenderObject& renderObject = kdTree.objects[object];
+        if (frustumCulling && !intersectsFrustum(objectBounds(renderObject), planes)) return;
+        kdTree.setRendered(world.leaf(object), true);
+        drawObject(renderObject);
+    };
+
+    // walls only hide what lies behind them for an eye below their top
+    bool traversed = eye.y() > 0.0f && eye.y() < cellHeight
+        && portalGraph.traverse(eye.x(), eye.z(), frustumCulling ? planes : nullptr,
+            [&](int cell) { return world.type(cellObjects[cell]) != GridCell::DOOR; },
+            [&](int cell) { draw(cellObjects[cell]); });
+    if (!traversed) {
+        for (int object = 0; object < (int)kdTree.objects.size(); object++) {
+            draw(object);
+        }
+    }
+}
+
+void MazeApp::traverseCHCPlusPlus(int node, const QVector3D& eye)
+{
+    if (kdTree.isLeaf(node)) {
+        drawObject(kdTree.object(node));
+        kdTree.setRendered(node, true);
+        pullUpVisibility(kdTree, kdTree.parent(node));
+    } else {
+        // inner nodes become visible again through their children
+        kdTree.setVisible(node, false);
+        const KdNode& kdNode = kdTree.nodes[node];
+        float eyeCoord = (kdNode.axis == 0) ? eye.x() : eye.z();
+        if (eyeCoord < kdNode.border) {
+            chcStack.push_back(kdTree.right(node));
+            chcStack.push_back(kdTree.left(node));
+        } else {
+            chcStack.push_back(kdTree.left(node));
+            chcStack.push_back(kdTree.right(node));
+        }
+    }
+}
+
+void MazeApp::issueVisibleQueries(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, size_t maxCount)
+{
+    constexpr int maxQueryInterval = 8; // visible leaves are queried again after 1..maxQueryInterval frames
+
+    size_t count = std::min(maxCount, chcVisibleQueue.size());
+    if (count == 0) return;
+
+    flushInstances();
+    queryPool.beginBatch(projectionMatrix, viewMatrix);
+    for (size_t i = chcVisibleQueue.size() - count; i < chcVisibleQueue.size(); i++) {
+        int node = chcVisibleQueue.at(i);
+        OcclusionQuery query = queryPool.acquire(node, chcView);
+        queryPool.beginQuery(query);
+        queryPool.drawProxy(kdTree.bounds[node]);
+        queryPool.endQuery();
+        ChcView& state = chcViews[chcView];
+        state.queries[state.queryFrame].push_back(query);
+        // randomized so that queries of nodes that became visible together spread over several frames
+        kdTree.history(node).nextQueryFrame = state.frame + 1 + chcRandom() % maxQueryInterval;
+    }
+    queryPool.endBatch();
+    chcVisibleQueue.resize(chcVisibleQueue.size() - count);
+}
+
+void MazeApp::issueMultiQueries(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix)
+{
+    constexpr size_t maxMultiQuerySize = 16;
+
+    if (chcInvisibleQueue.empty()) return;
+
+    // nodes that stayed invisible the longest are the most likely to stay invisible, group them first
+    std::sort(chcInvisibleQueue.begin(), chcInvisibleQueue.end(), [&](int a, int b) {
+        return kdTree.history(a).invisibleFrames > kdTree.history(b).invisibleFrames;
+    });
+
+    flushInstances();
+    queryPool.beginBatch(projectionMatrix, viewMatrix);
+    size_t i = 0;
+    while (i < chcInvisibleQueue.size()) {
+        // grow the multiquery as long as the expected number of nodes tested per query increases
+        float stayInvisible = 1.0f;
+        float bestValue = 0.0f;
+        size_t size = 0;
+        for (size_t k = 1; k <= maxMultiQuerySize && i + k <= chcInvisibleQueue.size(); k++) {
+            float t = kdTree.history(chcInvisibleQueue.at(i + k - 1)).invisibleFrames;
+            stayInvisible *= 0.99f - 0.7f * std::exp(-t);
+            // a failed multiquery costs one extra query per node
+            float cost = (k == 1) ? 1.0f : 1.0f + (1.0f - stayInvisible) * k;
+            float value = k / cost;
+            if (value <= bestValue) break;
+            bestValue = value;
+            size = k;
+        }
+        MultiQuery multiQuery;
+        multiQuery.query = queryPool.acquire(chcInvisibleQueue.at(i), chcView);
+        multiQuery.first = chcMultiQueryNodes.size();
+        multiQuery.count = size;
+        queryPool.beginQuery(multiQuery.query);
+        for (size_t k = 0; k < size; k++) {
+            int node = chcInvisibleQueue.at(i + k);
+            queryPool.drawProxy(kdTree.bounds[node]);
+            chcMultiQueryNodes.push_back(node);
+        }
+        queryPool.endQuery();
+        chcQueryQueue.push_back(multiQuery);
+        i += size;
+    }
+    queryPool.endBatch();
+    chcInvisibleQueue.clear();
+}
+
+bool MazeApp::collide(const QVector3D& position)
+{
+    constexpr float hitbox = 0.1f;  // you are a 20 cm wide cylinder
+    constexpr float collectionRange = 0.3f;
+    constexpr float wallRadius = 1.0f;
+
+    // cells are 2 units wide, so everything within reach lies in the 3x3 cells around the player
+    int playerRow = std::floor((gridHeight - position.z()) / 2.0f);
+    int playerCol = std::floor((position.x() + gridWidth) / 2.0f);
+    int firstRow = std::max(playerRow - 1, 0);
+    int lastRow = std::min(playerRow + 1, (int)gridHeight - 1);
+    int firstCol = std::max(playerCol - 1, 0);
+    int lastCol = std::min(playerCol + 1, (int)gridWidth - 1);
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int col = firstCol; col <= lastCol; col++) {
+            int objectIndex = cellObjects[row * gridWidth + col];
+            auto& object = kdTree.objects[objectIndex];
+            if (object.type == GridCell::WALL || object.type == GridCell::DOOR || object.type == GridCell::FINISH) {
+                auto wallCenter = object.position;
+                auto circleDistanceX = std::abs(position.x() - wallCenter.x);
+                auto circleDistanceY = std::abs(position.z() - wallCenter.y);
+                if (circleDistanceX > (wallRadius + hitbox)) continue;
+                if (circleDistanceY > (wallRadius + hitbox)) continue;
+                auto cornerDistance_sq = (circleDistanceX - wallRadius)*(circleDistanceX - wallRadius) +
+                    (circleDistanceY - wallRadius)*(circleDistanceY - wallRadius);
+                if (circleDistanceX <= wallRadius || circleDistanceY <= wallRadius ||
+                    cornerDistance_sq <= (hitbox*hitbox)) {
+                    // handle collision
+                    if (object.type == GridCell::FINISH) {
+                        _wantExit = true;
+                        return false;
+                    }
+                    return true;
+                }
+            }
+            if (object.type == GridCell::COIN) {
+                auto coinPos = object.position;
+                auto dist = (coinPos.x - position.x())*(coinPos.x - position.x()) + (coinPos.y - position.z())*(coinPos.y - position.z());
+                if (dist < (coinBoundingSphere + collectionRange) * (coinBoundingSphere + collectionRange)) {
+                    collectCoin(objectIndex);
+                    collectedCells.push_back(row * gridWidth + col);
+                    //for (int i = 0; i < deviceCount; i++) {
+                    //    auto device = QVRManager::device(i);
+                    //    if (device.supportsHapticPulse()) {
+                    //        device.triggerHapticPulse(1000);
+                    //    }
+                    //}
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void MazeApp::update(const QList<QVRObserver*>& observers)
+{
+    float runSpeed = 5.0f;
+    constexpr float sensitivity = 0.5f; // mouse sensitivity
+    static float timeInWall = 0.0f;
+    float seconds = 0.0f;
+    syncFrame++;
+    collectedCells.clear();
+    if (_timer.isValid()) {
+        seconds = _timer.nsecsElapsed() / 1e9f;
+        _timer.restart();
+    } else {
+        _timer.start();
+    }
+    // one turn later all coins look the same again
+    coinTime = std::fmod(coinTime + seconds, 360.0f / coinSpeed);
+
+    if (printStatistics) {
+        statisticsFrames++;
+        statisticsSeconds += seconds;
+        statisticsQueries += queryPool.takeIssuedQueries();
+        if (statisticsSeconds >= 1.0f) {
+            static const char* modeNames[] = { "none", "queries", "CHC", "CHC++", "GPU", "Hi-Z", "software", "PVS", "portals" };
+            std::cout << "culling: " << (frustumCulling ? "frustum + " : "") << modeNames[static_cast<int>(occlusionMode)]
+                << ", frame time: " << 1000.0f * statisticsSeconds / statisticsFrames << " ms"
+                << ", queries/frame: " << statisticsQueries / statisticsFrames << std::endl;
+            statisticsFrames = 0;
+            statisticsSeconds = 0.0f;
+            statisticsQueries = 0;
+        }
+    }
+
+    auto deviceCount = QVRManager::deviceCount();
+    auto observer = observers.at(0);    // only support one observer
+	if (observer->config().trackingType() == QVRTrackingType::QVR_Tracking_Device) {
+		runSpeed = 2.0f;
+	}
+
+    if (observer->config().navigationType() == QVRNavigationType::QVR_Navigation_Custom) {
+        QVector3D posUpdate;
+        auto orientation = observer->trackingOrientation();
+		if (observer->config().trackingType() == QVRTrackingType::QVR_Tracking_Stationary) {
+			orientation = observer->navigationOrientation();
+		}
+
+        float pitch, yaw, roll;
+        orientation.getEulerAngles(&pitch, &yaw, &roll);
+        QVector3D forward = QQuaternion::fromEulerAngles(0, yaw, roll) * QVector3D(0.0f, 0.0f, -1.0f);
+        QVector3D right = QQuaternion::fromEulerAngles(0, yaw, roll) * QVector3D(1.0f, 0.0f, 0.0f);
+
+        if (forwardPressed) {
+            posUpdate += runSpeed * seconds * forward;
+        }
+        if (backwardPressed) {
+            posUpdate -= runSpeed * seconds * forward;
+        }
+        if (rightPressed) {
+            posUpdate += runSpeed * seconds * right;
+        }
+        if (leftPressed) {
+            posUpdate -= runSpeed * seconds * right;
+        }
+        
+        yaw += mouseDx.x()*sensitivity;
+        pitch += mouseDx.y()*sensitivity;
+        if (pitch > 89.0f) {
+            pitch = 89.0f;
+        }
+        if (pitch < -89.0f) {
+            pitch = -89.0f;
+        }
+        auto newOrientation = QQuaternion::fromEulerAngles(pitch, yaw, roll);
+
+		if (observer->config().trackingType() != QVR_Tracking_Stationary) {
+			newOrientation = observer->navigationOrientation();
+		}
+
+        auto navigationPosition = observer->navigationPosition();
+        auto position = navigationPosition + observer->trackingPosition();
+        position += posUpdate;
+        navigationPosition += posUpdate;
+        bool collision = collide(position);
+        if (collision) {
+            observer->setNavigation(observer->navigationPosition(), newOrientation);
+        } else {
+            observer->setNavigation(navigationPosition, newOrientation);
+        }
+    } else {
+        auto navigationPosition = observer->navigationPosition();
+        auto position = navigationPosition + observer->trackingPosition();
+        bool collision = collide(position);
+        if (collision) {
+            timeInWall += seconds;
+            //for (int i = 0; i < deviceCount; i++) {
+            //    auto device = QVRManager::device(i);
+            //    if (device.supportsHapticPulse()) {
+            //        device.triggerHapticPulse(1000);
+            //    }
+            //}
+        } else {
+            timeInWall = 0.0f;
+        }
+
+        if (timeInWall > 1.0f) {
+            _wantExit = true;
+        }
+    }
+
+    playerPosition = observer->navigationPosition() + observer->trackingPosition();
+    mouseDx = QVector2D(0.0f, 0.0f);
+}
+
+void MazeApp::getNearFar(float& nearPlane, float& farPlane)
+{
+    nearPlane = nearDistance;
+    farPlane = farDistance;
+}
+
+bool MazeApp::wantExit()
+{
+    return _wantExit;
+}
+
+// Unsigned LEB128: 7 bits per byte, low bits first, the high bit set on all but the last byte
+static void writeVarint(QDataStream& ds, quint64 value)
+{
+    while (value >= 0x80) {
+        ds << quint8(value | 0x80);
+        value >>= 7;
+    }
+    ds << quint8(value);
+}
+
+static quint64 readVarint(QDataStream& ds)
+{
+    quint64 value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        quint8 byte = 0;
+        ds >> byte;
+        value |= quint64(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+// floats as their 4 bytes; a QDataStream writes 8 by default
+static void writeFloat(QDataStream& ds, float value)
+{
+    quint32 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    ds << bits;
+}
+
+static float readFloat(QDataStream& ds)
+{
+    quint32 bits = 0;
+    ds >> bits;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// bits of the flags written by serializeDynamicData
+constexpr unsigned int syncSnapshot = 1;
+constexpr unsigned int syncFrustumCulling = 2;
+constexpr unsigned int syncInstancedRendering = 4;
+constexpr unsigned int syncMergedGeometry = 8;
+constexpr unsigned int syncSinglePassStereo = 16;
+constexpr unsigned int syncNonBlockingReadback = 32;
+constexpr unsigned int syncChcDebug = 64;
+
+void MazeApp::serializeDynamicData(QDataStream& ds) const
+{
+    // The slaves load the same maze, so after the snapshot of the first frame only the coins
+    // collected in a frame are sent. The player picks up at most the coins of the cells around
+    // it, so the size of a frame does not depend on the size of the maze.
+    bool snapshot = (syncFrame <= 1);
+    unsigned int flags = (snapshot ? syncSnapshot : 0u)
+        | (frustumCulling ? syncFrustumCulling : 0)
+        | (instancedRendering ? syncInstancedRendering : 0)
+        | (mergedGeometry ? syncMergedGeometry : 0)
+        | (singlePassStereo ? syncSinglePassStereo : 0)
+        | (nonBlockingReadback ? syncNonBlockingReadback : 0)
+        | (chcDebug ? syncChcDebug : 0);
+    writeVarint(ds, flags);
+    writeVarint(ds, static_cast<quint64>(occlusionMode));
+    writeVarint(ds, debugLevel);
+    writeFloat(ds, coinTime);
+    writeFloat(ds, playerPosition.x());
+    writeFloat(ds, playerPosition.y());
+    writeFloat(ds, playerPosition.z());
+
+    // collected cells in ascending order, each as the distance to the one before
+    std::vector<int> cells = collectedCells;
+    std::sort(cells.begin(), cells.end());
+    writeVarint(ds, cells.size());
+    int previous = 0;
+    for (int cell : cells) {
+        writeVarint(ds, cell - previous);
+        previous = cell;
+    }
+
+    if (snapshot) {
+        // one bit per coin of the maze as loaded, in cell order, set if it is gone
+        int cellCount = gridWidth * gridHeight;
+        std::vector<quint8> collected;
+        int coins = 0;
+        for (int cell = 0; cell < cellCount; cell++) {
+            if (mazeGrid[cell] != GridCell::COIN) continue;
+            if (coins % 8 == 0) {
+                collected.push_back(0);
+            }
+            if (world.type(cellObjects[cell]) != GridCell::COIN) {
+                collected.back() |= 1u << (coins % 8);
+            }
+            coins++;
+        }
+        writeVarint(ds, coins);
+        for (quint8 byte : collected) {
+            ds << byte;
+        }
+    }
+}
+
+void MazeApp::deserializeDynamicData(QDataStream& ds)
+{
+    unsigned int flags = readVarint(ds);
+    frustumCulling = flags & syncFrustumCulling;
+    instancedRendering = flags & syncInstancedRendering;
+    mergedGeometry = flags & syncMergedGeometry;
+    singlePassStereo = flags & syncSinglePassStereo;
+    nonBlockingReadback = flags & syncNonBlockingReadback;
+    chcDebug = flags & syncChcDebug;
+    OcclusionMode mode = static_cast<OcclusionMode>(readVarint(ds));
+    if (mode != occlusionMode) {
+        setOcclusionMode(mode);
+    }
+    debugLevel = readVarint(ds);
+    coinTime = readFloat(ds);
+    float x = readFloat(ds);
+    float y = readFloat(ds);
+    float z = readFloat(ds);
+    playerPosition = QVector3D(x, y, z);
+
+    auto collect = [&](int cell) {
+        if (cell < 0 || cell >= (int)(gridWidth * gridHeight)) return;
+        int object = cellObjects[cell];
+        if (world.type(object) == GridCell::COIN) {
+            collectCoin(object);
+        }
+    };
+    int count = readVarint(ds);
+    int cell = 0;
+    for (int i = 0; i < count; i++) {
+        cell += readVarint(ds);
+        collect(cell);
+    }
+
+    if (flags & syncSnapshot) {
+        int coins = readVarint(ds);
+        std::vector<quint8> collected((coins + 7) / 8);
+        for (quint8& byte : collected) {
+            ds >> byte;
+        }
+        int coin = 0;
+        for (int cell = 0; cell < (int)(gridWidth * gridHeight) && coin < coins; cell++) {
+            if (mazeGrid[cell] != GridCell::COIN) continue;
+            if (collected[coin / 8] & (1u << (coin % 8))) {
+                collect(cell);
+            }
+            coin++;
+        }
+    }
+}
+
+void MazeApp::keyPressEvent(const QVRRenderContext& /* context */, QKeyEvent* event)
 {
     switch (event->key())
     {
@@ -959,24 +1521,47 @@ void MazeApp::keyPressEvent(const QVRRenderContext& /* context */, QKeyEvent* ev
         rightPressed = true;
         break;
     case Qt::Key_P:
-        if (occlusionCulling) occlusionCulling = false;
-        occlusionCullingCHC = !occlusionCullingCHC;
-        inOrder(kdTreeRoot, [](Node* node) {
-            node->visible = true;
-        });
+        toggleOcclusionMode(OcclusionMode::CHC);
         break;
     case Qt::Key_O:
-        if (occlusionCullingCHC) occlusionCullingCHC = false;
-        occlusionCulling = !occlusionCulling;
-        inOrder(kdTreeRoot, [](Node* node) {
-            node->visible = true;
-        });
+        toggleOcclusionMode(OcclusionMode::QUERIES);
+        break;
+    case Qt::Key_C:
+        toggleOcclusionMode(OcclusionMode::CHCPP);
+        break;
+    case Qt::Key_U:
+        toggleOcclusionMode(OcclusionMode::GPU);
+        break;
+    case Qt::Key_H:
+        toggleOcclusionMode(OcclusionMode::HIZ);
+        break;
+    case Qt::Key_R:
+        toggleOcclusionMode(OcclusionMode::SOFTWARE);
+        break;
+    case Qt::Key_V:
+        toggleOcclusionMode(OcclusionMode::PVS);
+        break;
+    case Qt::Key_L:
+        toggleOcclusionMode(OcclusionMode::PORTALS);
+        break;
+    case Qt::Key_T:
+        printStatistics = !printStatistics;
+        queryPool.takeIssuedQueries();
         break;
     case Qt::Key_F:
         frustumCulling = !frustumCulling;
-        inOrder(kdTreeRoot, [](Node* node) {
-            node->visible = true;
-        });
+        break;
+    case Qt::Key_I:
+        instancedRendering = !instancedRendering;
+        break;
+    case Qt::Key_M:
+        mergedGeometry = !mergedGeometry;
+        break;
+    case Qt::Key_B:
+        singlePassStereo = !singlePassStereo;
+        break;
+    case Qt::Key_N:
+        nonBlockingReadback = !nonBlockingReadback;
         break;
     case Qt::Key_G:
         chcDebug = false;
@@ -995,13 +1580,57 @@ void MazeApp::keyPressEvent(const QVRRenderContext& /* context */, QKeyEvent* ev
         break;
     }
 
-    if (event->key() > Qt::Key_0 && event->key() <= Qt::Key_9) {
-        debugLevel = event->key() - Qt::Key_0;
-        chcDebug = true;
+    if (event->key() > Qt::Key_0 && event->key() <= Qt::Key_9) {
+        debugLevel = event->key() - Qt::Key_0;
+        chcDebug = true;
+    }
+    if (event->key() == Qt::Key_0) {
+        debugLevel = 10;
+        chcDebug = true;
+    }
+}
+
+void MazeApp::toggleOcclusionMode(OcclusionMode mode)
+{
+    setOcclusionMode((occlusionMode == mode) ? OcclusionMode::NONE : mode);
+}
+
+void MazeApp::setOcclusionMode(OcclusionMode mode)
+{
+    occlusionMode = mode;
+    if (mode == OcclusionMode::PVS && pvs.empty()) {
+        // levels without a stored PVS only pay for tracing it when it is used
+        pvs.build(mazeGrid, gridWidth, gridHeight, std::thread::hardware_concurrency());
+    }
+    // Visibility flags from an earlier frame are only hints: CHC queries every node it finds
+    // invisible and waits for the result. Skipping a CHC++ frame makes all of its history stale.
+    for (ChcView& state : chcViews) {
+        state.frame++;
+    }
+    // the depth of frames rendered in another mode may be missing hidden cells that became visible
+    depthPyramid.invalidate();
+    for (auto& rasterizer : rasterizers) {
+        rasterizer.invalidate();
+    }
+}
+
+void MazeApp::collectCoin(int object)
+{
+    world.setType(object, GridCell::EMPTY);
+    if (world.count(GridCell::COIN) == 0) {
+        openDoors();
     }
-    if (event->key() == Qt::Key_0) {
-        debugLevel = 10;
-        chcDebug = true;
+}
+
+void MazeApp::openDoors()
+{
+    const auto& doors = world.objects(GridCell::DOOR);
+    while (!doors.empty()) {
+        world.setType(doors.back(), GridCell::EMPTY);
+    }
+    // the rasterized depth still holds the doors
+    for (auto& rasterizer : rasterizers) {
+        rasterizer.invalidate();
     }
 }
 
@@ -1083,7 +1712,19 @@ void MazeApp::deviceAnalogChangeEvent(QVRDeviceEvent* event)
 
 void MazeApp::exitProcess(QVRProcess* process)
 {
-    freeTree(kdTreeRoot);
+    for (auto& rasterizer : rasterizers) {
+        rasterizer.invalidate();
+    }
+    queryPool.destroy();
+    objectData.destroy();
+    gpuCulling.destroy();
+    coinBuffer.destroy();
+    depthPyramid.destroy();
+    renderTargets.destroy();
+    chunkStreamer.stop();
+    chunkBuffers.destroy();
+    glDeleteBuffers(1, &_viewUniformBuf);
+    glDeleteBuffers(1, &_stereoViewUniformBuf);
     delete[] mazeGrid;
 }
 
@@ -1107,136 +1748,791 @@ int main(int argc, char* argv[])
     return app.exec();
 }
 
-Node* kdTree(std::vector<RenderObject>& objects, int depth)
+// bound by reference in std::max
+constexpr float OcclusionQueryPool::proxyMinHalfHeight;
+
+void OcclusionQueryPool::init()
 {
-    if (objects.size() == 0) return nullptr;
-    if (objects.size() == 1)
-    {
-        Node* root = new Node;
-        root->data = objects.at(0);
-        root->isLeaf = true;
-        root->visible = true;
-        root->depth = depth;
-        root->left = nullptr;
-        root->right = nullptr;
-        return root;
-    }
-    int axis = depth % 2;
-
-    std::sort(objects.begin(), objects.end(), [&axis](RenderObject a, RenderObject b) {
-        if (axis == 0) {
-            return a.position.x < b.position.x;
-        } else {
-            return a.position.y < b.position.y;
-        }
-    });
-    RenderObject median = objects.at(objects.size() / 2);
-    Node* root = new Node;
-    root->axis = axis;
-    root->depth = depth;
-    root->isLeaf = false;
-    root->visible = true;
-    if (objects.size() % 2 != 0) {
-        if (axis == 0) {
-            root->border = median.position.x;
-        } else {
-            root->border = median.position.y;
+    static const GLfloat wallVertices[] = {
+        -1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   -1.0f, -1.0f, +1.0f, // front
+        -1.0f, +1.0f, -1.0f,   +1.0f, +1.0f, -1.0f,   +1.0f, -1.0f, -1.0f,   -1.0f, -1.0f, -1.0f, // back
+        +1.0f, +1.0f, -1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, -1.0f, // right
+        -1.0f, +1.0f, -1.0f,   -1.0f, +1.0f, +1.0f,   -1.0f, -1.0f, +1.0f,   -1.0f, -1.0f, -1.0f, // left
+        -1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, -1.0f,   -1.0f, +1.0f, -1.0f, // top
+        -1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, -1.0f,   -1.0f, -1.0f, -1.0f  // bottom
+    };
+
+    static const GLfloat wallNormals[] = {
+        0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f, // front
+        0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f, // back
+        +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f, // right
+        -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f, // left
+        0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f, // top
+        0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f  // bottom
+    };
+
+    static const GLuint wallIndices[] = {
+        0, 3, 1, 1, 3, 2, // front face
+        4, 5, 7, 5, 6, 7, // back face
+        8, 9, 11, 9, 10, 11, // right face
+        12, 15, 13, 13, 15, 14, // left face
+        16, 17, 19, 17, 18, 19, // top face
+        20, 23, 21, 21, 23, 22, // bottom face
+    };
+
+    initializeOpenGLFunctions();
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(3, buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(wallVertices), wallVertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(wallNormals), wallNormals, GL_STATIC_DRAW);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, 0);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[2]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(wallIndices), wallIndices, GL_STATIC_DRAW);
+    vaoIndices = 36;
+    prg.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader.glsl");
+    prg.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!prg.link()) {
+        qCritical("Could not link program! Check shaders!");
+    }
+    modelviewLocation = prg.uniformLocation("modelview_matrix");
+    normalLocation = prg.uniformLocation("normal_matrix");
+}
+
+void OcclusionQueryPool::destroy()
+{
+    if (!allIds.empty()) {
+        glDeleteQueries(allIds.size(), allIds.data());
+    }
+    allIds.clear();
+    freeIds.clear();
+    glDeleteBuffers(3, buffers);
+    glDeleteVertexArrays(1, &vao);
+    vao = 0;
+}
+
+OcclusionQuery OcclusionQueryPool::acquire(int node, int view)
+{
+    if (freeIds.empty()) {
+        GLuint ids[growSize];
+        glGenQueries(growSize, ids);
+        freeIds.insert(freeIds.end(), ids, ids + growSize);
+        allIds.insert(allIds.end(), ids, ids + growSize);
+    }
+    OcclusionQuery query;
+    query.id = freeIds.back();
+    query.node = node;
+    query.view = view;
+    freeIds.pop_back();
+    return query;
+}
+
+void OcclusionQueryPool::release(const OcclusionQuery& query)
+{
+    freeIds.push_back(query.id);
+}
+
+void OcclusionQueryPool::beginBatch(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix)
+{
+    batchViewMatrix = viewMatrix;
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
+    //glEnable(GL_CULL_FACE);
+    glBindVertexArray(vao);
+    glUseProgram(prg.programId());
+    prg.setUniformValue("projection_matrix", projectionMatrix);
+    prg.setUniformValue("view_matrix", viewMatrix);
+    prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
+}
+
+void OcclusionQueryPool::beginQuery(const OcclusionQuery& query)
+{
+    glBeginQuery(GL_ANY_SAMPLES_PASSED, query.id);
+    issuedQueries++;
+}
+
+void OcclusionQueryPool::drawProxy(const Bounds& bounds)
+{
+    QMatrix4x4 modelMatrix;
+    float scaleX = (bounds.xMax - bounds.xMin) / 2.0f;
+    float scaleY = (bounds.yMax - bounds.yMin) / 2.0f;
+    float scaleHeight = std::max((bounds.heightMax - bounds.heightMin) / 2.0f, proxyMinHalfHeight);
+    modelMatrix.translate((bounds.xMin + bounds.xMax) / 2.0f, (bounds.heightMin + bounds.heightMax) / 2.0f, (bounds.yMin + bounds.yMax) / 2.0f);
+    modelMatrix.scale(scaleX, scaleHeight, scaleY);
+    modelMatrix.scale(proxyScale);
+    QMatrix4x4 modelViewMatrix = batchViewMatrix * modelMatrix;
+    prg.setUniformValue(modelviewLocation, modelViewMatrix);
+    prg.setUniformValue(normalLocation, modelViewMatrix.normalMatrix());
+    glDrawElements(GL_TRIANGLES, vaoIndices, GL_UNSIGNED_INT, 0);
+}
+
+void OcclusionQueryPool::endQuery()
+{
+    glEndQuery(GL_ANY_SAMPLES_PASSED);
+}
+
+void OcclusionQueryPool::endBatch()
+{
+    glDepthFunc(GL_LESS);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    //glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
+
+void OcclusionQueryPool::start(const OcclusionQuery& query, const Bounds& bounds, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix)
+{
+    beginBatch(projectionMatrix, viewMatrix);
+    beginQuery(query);
+    drawProxy(bounds);
+    endQuery();
+    endBatch();
+}
+
+bool OcclusionQueryPool::isAvailable(const OcclusionQuery& query)
+{
+    GLuint available;
+    glGetQueryObjectuiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+    return available == GL_TRUE;
+}
+
+bool OcclusionQueryPool::getResult(const OcclusionQuery& query)
+{
+    GLuint visible;
+    glGetQueryObjectuiv(query.id, GL_QUERY_RESULT, &visible);
+
+    return visible;
+}
+
+unsigned int OcclusionQueryPool::takeIssuedQueries()
+{
+    unsigned int count = issuedQueries;
+    issuedQueries = 0;
+    return count;
+}
+
+void ObjectDataBuffer::init(GLsizei objects)
+{
+    initializeOpenGLFunctions();
+    allocate(std::max(objects, 1));
+}
+
+void ObjectDataBuffer::destroy()
+{
+    release();
+    vaos.clear();
+}
+
+void ObjectDataBuffer::allocate(GLsizei objects)
+{
+    // sections hold whole objects and start at the storage buffer offset alignment
+    GLint alignment;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    GLsizei step = 1;
+    while ((step * sizeof(ObjectData)) % alignment != 0) {
+        step++;
+    }
+    capacity = (objects + step - 1) / step * step;
+    sectionSize = capacity * sizeof(ObjectData);
+
+    glCreateBuffers(1, &buffer);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glNamedBufferStorage(buffer, sectionCount * sectionSize, NULL, flags);
+    mapped = static_cast<ObjectData*>(glMapNamedBufferRange(buffer, 0, sectionCount * sectionSize, flags));
+
+    std::vector<GLuint> indices(capacity);
+    for (GLsizei i = 0; i < capacity; i++) {
+        indices[i] = i;
+    }
+    glCreateBuffers(1, &indexBuffer);
+    glNamedBufferStorage(indexBuffer, capacity * sizeof(GLuint), indices.data(), 0);
+    glCreateBuffers(1, &commandBuffer);
+    GLsizeiptr commandsSize = sectionCount * capacity * sizeof(DrawElementsIndirectCommand);
+    glNamedBufferStorage(commandBuffer, commandsSize, NULL, flags);
+    mappedCommands = static_cast<DrawElementsIndirectCommand*>(glMapNamedBufferRange(commandBuffer, 0, commandsSize, flags));
+    for (GLuint vao : vaos) {
+        glVertexArrayVertexBuffer(vao, indexAttribute, indexBuffer, 0, sizeof(GLuint));
+    }
+}
+
+void ObjectDataBuffer::release()
+{
+    // draws that were already issued keep the storage alive until they are done
+    for (auto& fence : fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = 0;
         }
-    } else {
-        RenderObject median2 = objects.at(objects.size() / 2 - 1);
-        if (axis == 0) {
-            root->border = (median.position.x + median2.position.x) / 2.0f;
-        } else {
-            root->border = (median.position.y + median2.position.y) / 2.0f;
+    }
+    if (buffer) {
+        glUnmapNamedBuffer(buffer);
+        glUnmapNamedBuffer(commandBuffer);
+        glDeleteBuffers(1, &buffer);
+        glDeleteBuffers(1, &indexBuffer);
+        glDeleteBuffers(1, &commandBuffer);
+        buffer = 0;
+        indexBuffer = 0;
+        commandBuffer = 0;
+        mapped = nullptr;
+        mappedCommands = nullptr;
+    }
+}
+
+void ObjectDataBuffer::bindSection()
+{
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, buffer, section * sectionSize, sectionSize);
+}
+
+void ObjectDataBuffer::attach(GLuint vao)
+{
+    glVertexArrayVertexBuffer(vao, indexAttribute, indexBuffer, 0, sizeof(GLuint));
+    glVertexArrayBindingDivisor(vao, indexAttribute, 1);
+    glVertexArrayAttribIFormat(vao, indexAttribute, 1, GL_UNSIGNED_INT, 0);
+    glVertexArrayAttribBinding(vao, indexAttribute, indexAttribute);
+    glEnableVertexArrayAttrib(vao, indexAttribute);
+    vaos.push_back(vao);
+}
+
+void ObjectDataBuffer::setInstanceViews(GLuint views)
+{
+    for (GLuint vao : vaos) {
+        glVertexArrayBindingDivisor(vao, indexAttribute, views);
+    }
+}
+
+void ObjectDataBuffer::beginFrame()
+{
+    section = (section + 1) % sectionCount;
+    if (fences[section]) {
+        while (glClientWaitSync(fences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
         }
+        glDeleteSync(fences[section]);
+        fences[section] = 0;
+    }
+    used = 0;
+    usedCommands = 0;
+    bindSection();
+}
+
+void ObjectDataBuffer::endFrame()
+{
+    fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+ObjectData* ObjectDataBuffer::reserve(GLsizei count, GLuint& first)
+{
+    if (used + count > capacity) {
+        // a fresh buffer is not read by the GPU yet, so the frame continues in its first section
+        GLsizei objects = std::max(2 * capacity, count);
+        release();
+        allocate(objects);
+        section = 0;
+        used = 0;
+        usedCommands = 0;
+        bindSection();
+    }
+    first = used;
+    used += count;
+    return mapped + section * capacity + first;
+}
+
+DrawElementsIndirectCommand* ObjectDataBuffer::reserveCommands(GLsizei count, GLintptr& offset)
+{
+    DrawElementsIndirectCommand* commands = mappedCommands + section * capacity + usedCommands;
+    offset = (section * capacity + usedCommands) * sizeof(DrawElementsIndirectCommand);
+    usedCommands += count;
+    return commands;
+}
+
+void ChunkBuffers::init(int chunkCount, int slotCount)
+{
+    initializeOpenGLFunctions();
+    glCreateVertexArrays(1, &vao);
+    glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(vao, 0, 0);
+    glEnableVertexArrayAttrib(vao, 0);
+    glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_TRUE, 0);
+    glVertexArrayAttribBinding(vao, 1, 1);
+    glEnableVertexArrayAttrib(vao, 1);
+
+    GLsizeiptr vertexBytes = (GLsizeiptr)slotCount * MazeMesher::maxChunkVertices * 3 * sizeof(float);
+    glCreateBuffers(3, buffers);
+    glNamedBufferStorage(buffers[0], vertexBytes, NULL, GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(buffers[1], vertexBytes, NULL, GL_DYNAMIC_STORAGE_BIT);
+    glNamedBufferStorage(buffers[2], (GLsizeiptr)slotCount * MazeMesher::maxChunkIndices * sizeof(GLuint), NULL,
+            GL_DYNAMIC_STORAGE_BIT);
+    glVertexArrayVertexBuffer(vao, 0, buffers[0], 0, 3 * sizeof(float));
+    glVertexArrayVertexBuffer(vao, 1, buffers[1], 0, 3 * sizeof(float));
+    glVertexArrayElementBuffer(vao, buffers[2]);
+
+    slots.resize(slotCount);
+    freeSlots.clear();
+    for (int slot = slotCount - 1; slot >= 0; slot--) {
+        freeSlots.push_back(slot);
     }
-    
-    std::vector<RenderObject> left(&objects[0], &objects[objects.size() / 2]);
-    std::vector<RenderObject> right(&objects[objects.size() / 2], &objects.back() + 1);
-    root->left = kdTree(left, depth + 1);
-    if (root->left) {
-        root->left->parent = root;
+    chunkSlots.assign(chunkCount, -1);
+}
+
+void ChunkBuffers::destroy()
+{
+    glDeleteBuffers(3, buffers);
+    glDeleteVertexArrays(1, &vao);
+    for (auto& buffer : buffers) {
+        buffer = 0;
     }
-    root->right = kdTree(right, depth + 1);
-    if (root->right) {
-        root->right->parent = root;
+    vao = 0;
+    slots.clear();
+    freeSlots.clear();
+    chunkSlots.clear();
+}
+
+void ChunkBuffers::upload(const ChunkMesh& mesh)
+{
+    int& slot = chunkSlots[mesh.chunk];
+    if (slot < 0) {
+        // the streamer keeps the resident chunks within the slot count
+        if (freeSlots.empty()) return;
+        slot = freeSlots.back();
+        freeSlots.pop_back();
     }
-    return root;
+    // draws that still read the old mesh of the slot are done before the upload takes effect
+    GLintptr firstVertex = (GLintptr)slot * MazeMesher::maxChunkVertices;
+    glNamedBufferSubData(buffers[0], firstVertex * 3 * sizeof(float), mesh.positions.size() * sizeof(float),
+            mesh.positions.data());
+    glNamedBufferSubData(buffers[1], firstVertex * 3 * sizeof(float), mesh.normals.size() * sizeof(float),
+            mesh.normals.data());
+    glNamedBufferSubData(buffers[2], (GLintptr)slot * MazeMesher::maxChunkIndices * sizeof(GLuint),
+            mesh.indices.size() * sizeof(GLuint), mesh.indices.data());
+    std::copy(mesh.firstIndex, mesh.firstIndex + gridCellTypes + 1, slots[slot].firstIndex);
 }
 
-void calcBorders(Node* root)
+void ChunkBuffers::evict(int chunk)
 {
-    if (root == nullptr || root->isLeaf) return;
-    if (root->parent == nullptr) {
-        root->xMin = -32.0f;
-        root->xMax = 32.0f;
-        root->yMin = -32.0f;
-        root->yMax = 32.0f;
-        root->centerX = root->xMin + (root->xMax - root->xMin) / 2.0f;
-        root->centerY = root->yMin + (root->yMax - root->yMin) / 2.0f;
-    } else {
-        Node* parent = root->parent;
-        if (parent->axis == 0) {
-            if (parent->left == root) {
-                root->xMax = parent->border;
-                root->xMin = parent->xMin;
-                root->yMax = parent->yMax;
-                root->yMin = parent->yMin;
-            } else {
-                root->xMax = parent->xMax;
-                root->xMin = parent->border;
-                root->yMax = parent->yMax;
-                root->yMin = parent->yMin;
-            }
-        } else {
-            if (parent->left == root) {
-                root->xMax = parent->xMax;
-                root->xMin = parent->xMin;
-                root->yMax = parent->border;
-                root->yMin = parent->yMin;
-            } else {
-                root->xMax = parent->xMax;
-                root->xMin = parent->xMin;
-                root->yMax = parent->yMax;
-                root->yMin = parent->border;
-            }
+    if (chunkSlots[chunk] < 0) return;
+    freeSlots.push_back(chunkSlots[chunk]);
+    chunkSlots[chunk] = -1;
+}
+
+Mesh ChunkBuffers::mesh(int chunk, GridCell material) const
+{
+    int slot = chunkSlots[chunk];
+    int m = static_cast<int>(material);
+    Mesh mesh;
+    mesh.indexCount = slots[slot].firstIndex[m + 1] - slots[slot].firstIndex[m];
+    mesh.firstIndex = slot * MazeMesher::maxChunkIndices + slots[slot].firstIndex[m];
+    mesh.baseVertex = slot * MazeMesher::maxChunkVertices;
+    return mesh;
+}
+
+void DepthPyramid::init()
+{
+    initializeOpenGLFunctions();
+    prg.addShaderFromSourceFile(QOpenGLShader::Compute, ":compute-shader-depth-pyramid.glsl");
+    if (!prg.link()) {
+        qCritical("Could not link depth pyramid program! Check shaders!");
+    }
+}
+
+void DepthPyramid::destroy()
+{
+    for (auto& pyramid : views) {
+        glDeleteTextures(1, &pyramid.texture);
+        pyramid = ViewPyramid();
+    }
+    for (auto& readback : readbacks) {
+        glDeleteSync(readback.fence);
+        glDeleteBuffers(1, &readback.buffer);
+    }
+    views.clear();
+    readbacks.clear();
+}
+
+void RenderTargets::init()
+{
+    initializeOpenGLFunctions();
+    glCreateFramebuffers(2, resolveFbos);
+}
+
+void RenderTargets::destroy()
+{
+    for (Target& target : targets) {
+        glDeleteFramebuffers(1, &target.fbo);
+        glDeleteTextures(1, &target.depthTexture);
+        if (target.view < 0) {
+            glDeleteTextures(1, &target.colorTexture);
         }
-        root->centerX = root->xMin + (root->xMax - root->xMin) / 2.0f;
-        root->centerY = root->yMin + (root->yMax - root->yMin) / 2.0f;
     }
-    calcBorders(root->left);
-    calcBorders(root->right);
+    targets.clear();
+    glDeleteFramebuffers(2, resolveFbos);
 }
 
-void freeTree(Node* root)
+RenderTargets::Target& RenderTargets::target(const QString& window, int view)
 {
-    if (root == nullptr) {
-        return;
+    auto found = std::find_if(targets.begin(), targets.end(),
+            [&](const Target& target) { return target.view == view && target.window == window; });
+    if (found != targets.end()) return *found;
+    Target target;
+    target.window = window;
+    target.view = view;
+    glCreateFramebuffers(1, &target.fbo);
+    targets.push_back(target);
+    return targets.back();
+}
+
+GLuint RenderTargets::bind(const QString& window, int view, int width, int height, GLuint colorTexture)
+{
+    Target& target = this->target(window, view);
+    if (target.width != width || target.height != height) {
+        glDeleteTextures(1, &target.depthTexture);
+        target.width = width;
+        target.height = height;
+        glCreateTextures(GL_TEXTURE_2D, 1, &target.depthTexture);
+        glTextureStorage2D(target.depthTexture, 1, GL_DEPTH_COMPONENT24, width, height);
+        // the depth pyramid reads the single level with texelFetch
+        glTextureParameteri(target.depthTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glNamedFramebufferTexture(target.fbo, GL_DEPTH_ATTACHMENT, target.depthTexture, 0);
     }
-    freeTree(root->left);
-    freeTree(root->right);
-    delete root;
-    root = nullptr;
+    if (target.colorTexture != colorTexture) {
+        target.colorTexture = colorTexture;
+        glNamedFramebufferTexture(target.fbo, GL_COLOR_ATTACHMENT0, colorTexture, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    return target.depthTexture;
 }
 
-void pullUp(Node* node)
+void RenderTargets::bindStereo(const QString& window, int width, int height)
 {
-    if (node == nullptr || node->parent == nullptr) return;
-    if (!node->visible) {
-        if (node->parent->left == node) {
-            if (!node->parent->right->visible) {
-                node->parent->visible = false;
-                pullUp(node->parent);
-            }
-        } else {
-            if (!node->parent->left->visible) {
-                node->parent->visible = false;
-                pullUp(node->parent);
-            }
+    // a stereo target is kept under view -1 next to the targets of the single views
+    Target& target = this->target(window, -1);
+    if (target.width != width || target.height != height) {
+        glDeleteTextures(1, &target.depthTexture);
+        glDeleteTextures(1, &target.colorTexture);
+        target.width = width;
+        target.height = height;
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &target.depthTexture);
+        glTextureStorage3D(target.depthTexture, 1, GL_DEPTH_COMPONENT24, width, height, 2);
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &target.colorTexture);
+        glTextureStorage3D(target.colorTexture, 1, GL_RGBA8, width, height, 2);
+        // layered attachments, the geometry shader picks the layer
+        glNamedFramebufferTexture(target.fbo, GL_DEPTH_ATTACHMENT, target.depthTexture, 0);
+        glNamedFramebufferTexture(target.fbo, GL_COLOR_ATTACHMENT0, target.colorTexture, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+}
+
+void RenderTargets::resolveStereo(const QString& window, const unsigned int* textures)
+{
+    Target& target = this->target(window, -1);
+    for (int view = 0; view < 2; view++) {
+        glNamedFramebufferTextureLayer(resolveFbos[0], GL_COLOR_ATTACHMENT0, target.colorTexture, 0, view);
+        glNamedFramebufferTexture(resolveFbos[1], GL_COLOR_ATTACHMENT0, textures[view], 0);
+        glBlitNamedFramebuffer(resolveFbos[0], resolveFbos[1], 0, 0, target.width, target.height,
+                0, 0, target.width, target.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+}
+
+void DepthPyramid::build(int view, GLuint depthTexture, int width, int height, const QMatrix4x4& viewProjectionMatrix)
+{
+    constexpr int groupSize = 8;    // local size of compute-shader-depth-pyramid.glsl
+
+    if (view >= (int)views.size()) {
+        views.resize(view + 1);
+        readbacks.resize(view + 1);
+    }
+    ViewPyramid& pyramid = views[view];
+    if (pyramid.width != width || pyramid.height != height) {
+        // immutable storage, so a new size needs a new texture
+        glDeleteTextures(1, &pyramid.texture);
+        pyramid.width = width;
+        pyramid.height = height;
+        pyramid.levels = 1;
+        while ((std::max(width, height) >> pyramid.levels) > 0) {
+            pyramid.levels++;
         }
+        glCreateTextures(GL_TEXTURE_2D, 1, &pyramid.texture);
+        glTextureStorage2D(pyramid.texture, pyramid.levels, GL_R32F, width, height);
+    }
+
+    glUseProgram(prg.programId());
+    glBindTextureUnit(0, depthTexture);
+    for (int level = 0; level < pyramid.levels; level++) {
+        int levelWidth = std::max(width >> level, 1);
+        int levelHeight = std::max(height >> level, 1);
+        prg.setUniformValue("from_depth", level == 0);
+        if (level > 0) {
+            glBindImageTexture(0, pyramid.texture, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        }
+        glBindImageTexture(1, pyramid.texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((levelWidth + groupSize - 1) / groupSize, (levelHeight + groupSize - 1) / groupSize, 1);
+        // each level reads the one written before
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glBindTextureUnit(0, 0);
+    pyramid.viewProjectionMatrix = viewProjectionMatrix;
+    pyramid.valid = true;
+}
+
+void DepthPyramid::invalidate()
+{
+    for (auto& pyramid : views) {
+        pyramid.valid = false;
+    }
+    for (auto& readback : readbacks) {
+        glDeleteSync(readback.fence);
+        readback.fence = 0;
+    }
+}
+
+void DepthPyramid::requestRead(int view, int maxSize)
+{
+    if (!valid(view)) return;
+    const ViewPyramid& pyramid = views[view];
+    Readback& readback = readbacks[view];
+    int first = 0;
+    while (first + 1 < pyramid.levels && std::max(pyramid.width >> first, pyramid.height >> first) > maxSize) {
+        first++;
+    }
+    readback.levels.resize(pyramid.levels - first);
+    GLsizeiptr size = 0;
+    for (size_t i = 0; i < readback.levels.size(); i++) {
+        DepthLevel& level = readback.levels[i];
+        level.width = std::max(pyramid.width >> (first + i), 1);
+        level.height = std::max(pyramid.height >> (first + i), 1);
+        size += level.width * level.height * sizeof(float);
+    }
+    if (readback.size < size) {
+        glDeleteBuffers(1, &readback.buffer);
+        glCreateBuffers(1, &readback.buffer);
+        glNamedBufferStorage(readback.buffer, size, NULL, GL_MAP_READ_BIT);
+        readback.size = size;
+    }
+
+    // the copy runs behind the draw calls of the frame; the next frame takes its result
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    GLintptr offset = 0;
+    for (size_t i = 0; i < readback.levels.size(); i++) {
+        GLsizei levelSize = readback.levels[i].width * readback.levels[i].height * sizeof(float);
+        glGetTextureImage(pyramid.texture, first + i, GL_RED, GL_FLOAT, levelSize, (void*)offset);
+        offset += levelSize;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteSync(readback.fence);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.viewProjectionMatrix = pyramid.viewProjectionMatrix;
+}
+
+bool DepthPyramid::takeRead(int view, std::vector<DepthLevel>& levels, QMatrix4x4& viewProjectionMatrix)
+{
+    if (view >= (int)readbacks.size()) return false;
+    Readback& readback = readbacks[view];
+    if (!readback.fence || glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        return false;
+    }
+    glDeleteSync(readback.fence);
+    readback.fence = 0;
+    const unsigned char* mapped = static_cast<const unsigned char*>(
+            glMapNamedBufferRange(readback.buffer, 0, readback.size, GL_MAP_READ_BIT));
+    levels.resize(readback.levels.size());
+    for (size_t i = 0; i < levels.size(); i++) {
+        levels[i].width = readback.levels[i].width;
+        levels[i].height = readback.levels[i].height;
+        levels[i].depth.assign(reinterpret_cast<const float*>(mapped),
+                reinterpret_cast<const float*>(mapped) + levels[i].width * levels[i].height);
+        mapped += levels[i].width * levels[i].height * sizeof(float);
+    }
+    glUnmapNamedBuffer(readback.buffer);
+    viewProjectionMatrix = readback.viewProjectionMatrix;
+    return true;
+}
+
+void GpuCulling::init(const KdTree& tree, GLuint positionBuffer, GLuint normalBuffer, GLuint indexBuffer, const Mesh* meshes)
+{
+    initializeOpenGLFunctions();
+    cellCount = tree.objects.size();
+    std::vector<CellData> cells(cellCount);
+    for (GLsizei i = 0; i < cellCount; i++) {
+        cells[i].position[0] = tree.objects[i].position.x;
+        cells[i].position[1] = tree.objects[i].position.y;
+        cells[i].type = static_cast<GLuint>(tree.objects[i].type);
+        cells[i].pad = 0;
+    }
+    glCreateBuffers(1, &cellBuffer);
+    glNamedBufferStorage(cellBuffer, std::max<size_t>(cells.size(), 1) * sizeof(CellData), cells.data(), GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &visibleBuffer);
+    glNamedBufferStorage(visibleBuffer, std::max(meshCount * cellCount, 1) * sizeof(GLuint), NULL, 0);
+
+    // every frame starts from commands without instances; mesh i draws from the i-th range
+    for (int i = 0; i < meshCount; i++) {
+        emptyCommands[i].count = meshes[i].indexCount;
+        emptyCommands[i].instanceCount = 0;
+        emptyCommands[i].firstIndex = meshes[i].firstIndex;
+        emptyCommands[i].baseVertex = meshes[i].baseVertex;
+        emptyCommands[i].baseInstance = i * cellCount;
     }
+    glCreateBuffers(1, &commandBuffer);
+    glNamedBufferStorage(commandBuffer, sizeof(emptyCommands), emptyCommands, GL_DYNAMIC_STORAGE_BIT);
+
+    glCreateVertexArrays(1, &vao);
+    glVertexArrayVertexBuffer(vao, 0, positionBuffer, 0, 3 * sizeof(GLfloat));
+    glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(vao, 0, 0);
+    glEnableVertexArrayAttrib(vao, 0);
+    glVertexArrayVertexBuffer(vao, 1, normalBuffer, 0, 3 * sizeof(GLfloat));
+    glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_TRUE, 0);
+    glVertexArrayAttribBinding(vao, 1, 1);
+    glEnableVertexArrayAttrib(vao, 1);
+    glVertexArrayVertexBuffer(vao, cellAttribute, visibleBuffer, 0, sizeof(GLuint));
+    glVertexArrayBindingDivisor(vao, cellAttribute, 1);
+    glVertexArrayAttribIFormat(vao, cellAttribute, 1, GL_UNSIGNED_INT, 0);
+    glVertexArrayAttribBinding(vao, cellAttribute, cellAttribute);
+    glEnableVertexArrayAttrib(vao, cellAttribute);
+    glVertexArrayElementBuffer(vao, indexBuffer);
+
+    cullPrg.addShaderFromSourceFile(QOpenGLShader::Compute, ":compute-shader-cull.glsl");
+    if (!cullPrg.link()) {
+        qCritical("Could not link culling program! Check shaders!");
+    }
+    drawPrg.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader-cells.glsl");
+    drawPrg.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
+    if (!drawPrg.link()) {
+        qCritical("Could not link cell program! Check shaders!");
+    }
+}
+
+void GpuCulling::destroy()
+{
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &cellBuffer);
+    glDeleteBuffers(1, &visibleBuffer);
+    glDeleteBuffers(1, &commandBuffer);
+    vao = 0;
+    cellBuffer = 0;
+    visibleBuffer = 0;
+    commandBuffer = 0;
+}
+
+void GpuCulling::updateCells(const KdTree& tree, const std::vector<int>& objects)
+{
+    // only the type of a cell changes
+    for (int object : objects) {
+        GLuint type = static_cast<GLuint>(tree.objects[object].type);
+        glNamedBufferSubData(cellBuffer, object * sizeof(CellData) + offsetof(CellData, type), sizeof(GLuint), &type);
+    }
+}
+
+void GpuCulling::cull(int view, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, bool frustumCulling,
+        const DepthPyramid& pyramid)
+{
+    constexpr GLuint groupSize = 64;    // local size of compute-shader-cull.glsl
+
+    QVector4D planes[6];
+    frustumPlanes(projectionMatrix * viewMatrix, planes);
+    bool occlusionCulling = pyramid.valid(view);
+
+    glNamedBufferSubData(commandBuffer, 0, sizeof(emptyCommands), emptyCommands);
+    glUseProgram(cullPrg.programId());
+    cullPrg.setUniformValue("cell_count", static_cast<GLuint>(cellCount));
+    cullPrg.setUniformValue("frustum_culling", frustumCulling);
+    cullPrg.setUniformValueArray("frustum_planes", planes, 6);
+    cullPrg.setUniformValue("occlusion_culling", occlusionCulling);
+    if (occlusionCulling) {
+        cullPrg.setUniformValue("pyramid_matrix", pyramid.viewProjectionMatrix(view));
+        glBindTextureUnit(0, pyramid.texture(view));
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cellBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, commandBuffer);
+    glDispatchCompute((cellCount + groupSize - 1) / groupSize, 1, 1);
+    // the results are read as draw commands and instanced attributes
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    glBindTextureUnit(0, 0);
+}
+
+void GpuCulling::draw(float coinTime)
+{
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+    glUseProgram(drawPrg.programId());
+    drawPrg.setUniformValue("time", coinTime);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cellBuffer);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, meshCount, 0);
 }
 
-GLuint OcclusionQuery::vao;
-QOpenGLShaderProgram OcclusionQuery::prg;
-unsigned int OcclusionQuery::vaoIndices;
+void CoinBuffer::init(const KdTree& tree)
+{
+    initializeOpenGLFunctions();
+    objectSlots.assign(tree.objects.size(), -1);
+    slotObjects.clear();
+    std::vector<CoinData> coins;
+    for (int i = 0; i < (int)tree.objects.size(); i++) {
+        if (tree.objects[i].type != GridCell::COIN) continue;
+        CoinData coin;
+        coin.position[0] = tree.objects[i].position.x;
+        coin.position[1] = tree.objects[i].position.y;
+        // neighboring coins are a little apart in their turn
+        coin.phase = coinPhaseScale * (coin.position[0] + coin.position[1]);
+        coin.pad = 0.0f;
+        objectSlots[i] = coins.size();
+        slotObjects.push_back(i);
+        coins.push_back(coin);
+    }
+    count = coins.size();
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, std::max<size_t>(coins.size(), 1) * sizeof(CoinData), coins.data(), GL_DYNAMIC_STORAGE_BIT);
+    // coins are never added, so every draw fits
+    glCreateBuffers(1, &visibleBuffer);
+    glNamedBufferStorage(visibleBuffer, std::max<size_t>(coins.size(), 1) * sizeof(GLuint), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    visibleSlots.reserve(coins.size());
+    slotDraws.assign(coins.size(), 0);
+}
+
+void CoinBuffer::destroy()
+{
+    glDeleteBuffers(1, &buffer);
+    glDeleteBuffers(1, &visibleBuffer);
+    buffer = 0;
+    visibleBuffer = 0;
+    count = 0;
+    visibleSlots.clear();
+    slotDraws.clear();
+}
+
+GLsizei CoinBuffer::uploadVisible()
+{
+    // each coin is added once per draw, so the list fits the buffer sized for all coins
+    GLsizei visibleCount = std::min<GLsizei>(visibleSlots.size(), count);
+    if (visibleCount > 0) {
+        glNamedBufferSubData(visibleBuffer, 0, visibleCount * sizeof(GLuint), visibleSlots.data());
+    }
+    visibleSlots.clear();
+    draw++;
+    return visibleCount;
+}
+
+void CoinBuffer::update(const KdTree& tree, const std::vector<int>& objects)
+{
+    // coins are only ever removed; the last coin moves into the slot of a removed one
+    for (int object : objects) {
+        int slot = objectSlots[object];
+        if (slot < 0 || tree.objects[object].type == GridCell::COIN) continue;
+        int last = count - 1;
+        if (slot != last) {
+            glCopyNamedBufferSubData(buffer, buffer, last * sizeof(CoinData), slot * sizeof(CoinData), sizeof(CoinData));
+            slotObjects[slot] = slotObjects[last];
+            objectSlots[slotObjects[slot]] = slot;
+        }
+        slotObjects.pop_back();
+        objectSlots[object] = -1;
+        count--;
+    }
+}
@@ -5,220 +5,391 @@
 #include <QElapsedTimer>
 #include <vector>
 #include <list>
+#include <deque>
+#include <random>
 #include <algorithm>
 
 #include <qvr/app.hpp>
 #include <qvr/device.hpp>
 
-enum class GridCell : int
+#include "KdTree.hpp"
+#include "WorldState.hpp"
+#include "OcclusionRasterizer.hpp"
+#include "PotentiallyVisibleSet.hpp"
+#include "PortalGraph.hpp"
+#include "ChunkStreamer.hpp"
+
+enum class OcclusionMode : int
 {
-    EMPTY,
-    WALL,
-    FINISH,
-    SPAWN,
-    COIN,
-    DOOR
+    NONE,
+    QUERIES,    // one blocking query per leaf
+    CHC,        // coherent hierarchical culling
+    CHCPP,      // CHC++ with query batching and multiqueries
+    GPU,        // all cells culled by a compute shader against the previous frame's depth
+    HIZ,        // nodes tested on the CPU against the depth pyramid of the previous frame, read back asynchronously
+    SOFTWARE,   // nodes tested against walls rasterized on the CPU in the previous frame
+    PVS,        // cells in the potentially visible set of the eye's cell
+    PORTALS     // regions seen through the portals between them
 };
 
-struct Point
+// shader data of one drawn object, laid out like ObjectData in vertex-shader-objects.glsl (std430)
+struct ObjectData
 {
-    float x;
-    float y;
+    float modelMatrix[16];  // column-major
+    float color[4];
+};
 
-    Point(float x, float y)
-        :x(x), y(y)
-    {
+// shader data of one maze cell, laid out like Cell in compute-shader-cull.glsl (std430)
+struct CellData
+{
+    float position[2];  // grid position, which is the world xz position
+    GLuint type;        // GridCell
+    GLuint pad;
+};
 
-    }
+constexpr float coinSpeed = 100.0f;     // degrees per second, also in the coin vertex shaders
+constexpr float coinPhaseScale = 0.25f; // phase in radians per world unit along x and z
+
+// shader data of one coin, laid out like Coin in vertex-shader-coins.glsl (std430)
+struct CoinData
+{
+    float position[2];  // world xz position of its cell
+    float phase;        // added to the spin angle of all coins, in radians
+    float pad;
 };
 
-struct RenderObject
+// command layout of glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
 {
-    Point position = Point(0.0,0.0);
-    GridCell type;
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
 };
 
-struct Node
+// a mesh in the shared vertex and index buffers
+struct Mesh
 {
-    RenderObject data;
-    int axis;
-    int depth;
-    float border;
-    float centerX, centerY;
-    float xMin, xMax;
-    float yMin, yMax;
-    Node* left = nullptr;
-    Node* right = nullptr;
-    Node* parent = nullptr;
-    bool isLeaf;
-    bool visible;
-    bool renderedThisFrame=false;
+    GLuint indexCount;
+    GLuint firstIndex;
+    GLint baseVertex;
 };
 
-class OcclusionQuery : protected QOpenGLFunctions_4_5_Core
+// per-view uniform block View in vertex-shader-objects.glsl (std140)
+struct ViewData
 {
-private:
-    static constexpr GLfloat wallVertices[] = {
-        -1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   -1.0f, -1.0f, +1.0f, // front
-        -1.0f, +1.0f, -1.0f,   +1.0f, +1.0f, -1.0f,   +1.0f, -1.0f, -1.0f,   -1.0f, -1.0f, -1.0f, // back
-        +1.0f, +1.0f, -1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, -1.0f, // right
-        -1.0f, +1.0f, -1.0f,   -1.0f, +1.0f, +1.0f,   -1.0f, -1.0f, +1.0f,   -1.0f, -1.0f, -1.0f, // left
-        -1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, +1.0f,   +1.0f, +1.0f, -1.0f,   -1.0f, +1.0f, -1.0f, // top
-        -1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, +1.0f,   +1.0f, -1.0f, -1.0f,   -1.0f, -1.0f, -1.0f  // bottom
-    };
+    float projectionMatrix[16];
+    float viewMatrix[16];
+};
 
-    static constexpr GLfloat wallNormals[] = {
-        0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f,   0.0f, 0.0f, +1.0f, // front
-        0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f, // back
-        +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f,   +1.0f, 0.0f, 0.0f, // right
-        -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f,   -1.0f, 0.0f, 0.0f, // left
-        0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f,   0.0f, +1.0f, 0.0f, // top
-        0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f,   0.0f, -1.0f, 0.0f  // bottom
-    };
+// uniform block StereoView in vertex-shader-objects-stereo.glsl (std140), left eye first
+struct StereoViewData
+{
+    float projectionMatrices[2][16];
+    float viewMatrices[2][16];
+};
 
-    static constexpr GLuint wallIndices[] = {
-        0, 3, 1, 1, 3, 2, // front face
-        4, 5, 7, 5, 6, 7, // back face
-        8, 9, 11, 9, 10, 11, // right face
-        12, 15, 13, 13, 15, 14, // left face
-        16, 17, 19, 17, 18, 19, // top face
-        20, 23, 21, 21, 23, 22, // bottom face
-    };
+struct OcclusionQuery
+{
+    GLuint id;
+    int node;
+    int view;       // the view the query was issued for, see ChcView
+};
 
-    static GLuint vao;
-    static QOpenGLShaderProgram prg;
-    static unsigned int vaoIndices;
-    GLuint queryId;
-    Node* node;
+constexpr int queryFrames = 3;  // frames of visible-node queries that may be in flight
+
+// Occlusion query state of one window view. Eyes and windows keep their own, so the results of
+// one view never stand in for those of another; its index is also its view in the kd-tree and
+// its software occlusion rasterizer and depth pyramid.
+struct ChcView
+{
+    QString window;
+    int view;
+    std::vector<OcclusionQuery> queries[queryFrames];   // ring buffer, one entry per frame
+    int queryFrame = 0;
+    int frame = 0;      // CHC++ frames this view was rendered in
+};
+
+// a CHC++ query that covers the nodes [first, first + count) of the multiquery node list
+struct MultiQuery
+{
+    OcclusionQuery query;
+    size_t first;
+    size_t count;
+};
+
+// Owns the GL query objects and the proxy geometry used for occlusion queries.
+// Query ids are recycled across frames instead of being generated per query.
+class OcclusionQueryPool : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    static constexpr int growSize = 64;   // query objects generated at once when the pool is empty
+
+    static constexpr float proxyScale = 1.01f;   // keeps proxies in front of the geometry they enclose
+    static constexpr float proxyMinHalfHeight = 0.01f;   // lifts the proxies of flat floor regions off the floor
+
+    GLuint vao = 0;
+    GLuint buffers[3];
+    QOpenGLShaderProgram prg;
+    int modelviewLocation;
+    int normalLocation;
+    unsigned int vaoIndices;
+    std::vector<GLuint> freeIds;
+    std::vector<GLuint> allIds;
+    QMatrix4x4 batchViewMatrix;
+    unsigned int issuedQueries = 0;
 public:
-    OcclusionQuery(Node* node)
-    {
-        initializeOpenGLFunctions();
-        this->node = node;
-        glGenQueries(1, &queryId);
-        if (vao == 0) {
-            glGenVertexArrays(1, &vao);
-            glBindVertexArray(vao);
-            GLuint positionBuf;
-            glGenBuffers(1, &positionBuf);
-            glBindBuffer(GL_ARRAY_BUFFER, positionBuf);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(wallVertices), wallVertices, GL_STATIC_DRAW);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(0);
-            GLuint normalBuf;
-            glGenBuffers(1, &normalBuf);
-            glBindBuffer(GL_ARRAY_BUFFER, normalBuf);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(wallNormals), wallNormals, GL_STATIC_DRAW);
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, 0);
-            glEnableVertexAttribArray(1);
-            GLuint indexBuf;
-            glGenBuffers(1, &indexBuf);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuf);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(wallIndices), wallIndices, GL_STATIC_DRAW);
-            vaoIndices = 36;
-            prg.addShaderFromSourceFile(QOpenGLShader::Vertex, ":vertex-shader.glsl");
-            prg.addShaderFromSourceFile(QOpenGLShader::Fragment, ":fragment-shader.glsl");
-            if (!prg.link()) {
-                qCritical("Could not link program! Check shaders!");
-            }
-        }
-    }
+    void init();
+    void destroy();
+
+    OcclusionQuery acquire(int node, int view);
+    void release(const OcclusionQuery& query);
+
+    // Queries issued between beginBatch and endBatch share one set of state changes.
+    void beginBatch(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix);
+    void beginQuery(const OcclusionQuery& query);
+    void drawProxy(const Bounds& bounds);
+    void endQuery();
+    void endBatch();
+
+    // issues a single query in its own batch
+    void start(const OcclusionQuery& query, const Bounds& bounds, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix);
+    bool isAvailable(const OcclusionQuery& query);
+    // true if any sample passed; the driver blocks until the result is available
+    bool getResult(const OcclusionQuery& query);
+
+    // number of queries issued since the last call
+    unsigned int takeIssuedQueries();
+};
 
-    ~OcclusionQuery()
-    {
-        glDeleteQueries(1, &queryId);
-    }
+// Per-frame object data and indirect draw commands in persistently mapped buffers. The buffers
+// are split into sections that are used round-robin and guarded by fences, so the CPU fills one
+// section while the GPU may still read the previous ones. Draws index the objects of the current
+// section through an instanced index attribute that is offset by the base instance.
+class ObjectDataBuffer : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    static constexpr int sectionCount = 3;
+    static constexpr GLuint indexAttribute = 2;
+
+    GLuint buffer = 0;
+    GLuint indexBuffer = 0;     // 0, 1, 2, ...
+    GLuint commandBuffer = 0;
+    ObjectData* mapped = nullptr;
+    DrawElementsIndirectCommand* mappedCommands = nullptr;
+    GLsizeiptr sectionSize = 0; // in bytes, a multiple of the storage buffer offset alignment
+    GLsizei capacity = 0;       // objects and commands per section
+    GLsizei used = 0;           // objects written to the current section
+    GLsizei usedCommands = 0;
+    int section = 0;
+    GLsync fences[sectionCount] = {};
+    std::vector<GLuint> vaos;   // vertex array objects that read the index attribute
+
+    void allocate(GLsizei objects);
+    void release();
+    void bindSection();
+public:
+    void init(GLsizei objects);
+    void destroy();
+
+    // adds the index attribute to a vertex array object
+    void attach(GLuint vao);
+    // advances the index attribute every views instances, for draws that repeat each object per view
+    void setInstanceViews(GLuint views);
+
+    // waits until the GPU no longer reads the next section and makes it current
+    void beginFrame();
+    void endFrame();
+
+    // returns room for count objects in the current section; first is the base instance to draw them with
+    ObjectData* reserve(GLsizei count, GLuint& first);
+    // Returns room for count commands in the current section; offset is their byte offset in the
+    // command buffer. Each command draws at least one object reserved before, so the commands
+    // never run out before the objects.
+    DrawElementsIndirectCommand* reserveCommands(GLsizei count, GLintptr& offset);
+    GLuint commands() const { return commandBuffer; }
+};
 
-    void start(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix)
+// Maximum depth mip chains of rendered depth textures, one per window view (see ChcView), built
+// by a compute shader.
+// Level 0 copies the depth texture and every further level keeps the farthest depth of the
+// texels below it, so a box whose nearest depth lies behind a texel of a level is hidden.
+class DepthPyramid : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    struct ViewPyramid
     {
-        glBeginQuery(GL_ANY_SAMPLES_PASSED, queryId);
-        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-        //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        glDepthMask(GL_FALSE);
-        //glEnable(GL_CULL_FACE);
-        glBindVertexArray(vao);
-        glUseProgram(prg.programId());
-        QMatrix4x4 modelMatrix;
-        if (!node->isLeaf) {
-            float scaleX = (node->xMax - node->xMin)/2.0f;
-            float scaleY = (node->yMax - node->yMin)/2.0f;
-            modelMatrix.translate(node->centerX, 1.0f, node->centerY);
-            modelMatrix.scale(scaleX, 1.0f, scaleY);
-        } else {
-            float x = node->data.position.x;
-            float y = node->data.position.y;
-            modelMatrix.translate(x, 1.0f, y);
-        }
-        QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
-        prg.setUniformValue("projection_matrix", projectionMatrix);
-        prg.setUniformValue("modelview_matrix", modelViewMatrix);
-        prg.setUniformValue("view_matrix", viewMatrix);
-        prg.setUniformValue("normal_matrix", modelViewMatrix.normalMatrix());
-        prg.setUniformValue("color", QVector3D(0.0f, 1.0f, 0.0f));
-        glDrawElements(GL_TRIANGLES, vaoIndices, GL_UNSIGNED_INT, 0);
-        glEndQuery(GL_ANY_SAMPLES_PASSED);
-        //glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    }
+        GLuint texture = 0;     // GL_R32F with all mip levels
+        int width = 0;
+        int height = 0;
+        int levels = 0;
+        bool valid = false;
+        QMatrix4x4 viewProjectionMatrix;    // the depth was rendered with
+    };
 
-    bool isAvailable()
+    // levels of a pyramid copied into a pixel pack buffer, mapped once the copy has finished
+    struct Readback
     {
-        GLuint available;
-        glGetQueryObjectuiv(queryId, GL_QUERY_RESULT_AVAILABLE, &available);
-        return available == GL_TRUE;
-    }
+        GLuint buffer = 0;
+        GLsizeiptr size = 0;    // of the buffer in bytes
+        GLsync fence = 0;       // set while a copy is in flight
+        std::vector<DepthLevel> levels;     // sizes of the copied levels, finest first
+        QMatrix4x4 viewProjectionMatrix;
+    };
 
-    bool getResult()
-    {
-        GLuint visible;
-        glGetQueryObjectuiv(queryId, GL_QUERY_RESULT, &visible);
-        
-        return visible;
-    }
+    std::vector<ViewPyramid> views;     // added by the first build of a view
+    std::vector<Readback> readbacks;
+    QOpenGLShaderProgram prg;
+public:
+    void init();
+    void destroy();
+
+    // builds the pyramid of a view from its depth texture, right after the view is rendered
+    void build(int view, GLuint depthTexture, int width, int height, const QMatrix4x4& viewProjectionMatrix);
+    // marks all pyramids and their readbacks as outdated, e.g. when they were not built in the last frame
+    void invalidate();
+    // starts copying the levels of a view that are at most maxSize texels wide and high to the CPU
+    void requestRead(int view, int maxSize);
+    // Hands over the levels of the last requested copy of a view, finest first, and the matrix
+    // they were rendered with. Returns false without waiting if the copy has not finished.
+    bool takeRead(int view, std::vector<DepthLevel>& levels, QMatrix4x4& viewProjectionMatrix);
+
+    bool valid(int view) const { return view < (int)views.size() && views[view].valid; }
+    GLuint texture(int view) const { return views[view].texture; }
+    const QMatrix4x4& viewProjectionMatrix(int view) const { return views[view].viewProjectionMatrix; }
+};
 
-    Node* getNode()
-    {
-        return node;
-    }
+// Culls all maze cells in a compute shader against the view frustum and the depth pyramid of
+// the previous frame. Visible cells are appended to one range per mesh in a cell index buffer
+// and counted in indirect draw commands, so the CPU neither visits cells nor reads results back.
+class GpuCulling : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    static constexpr int meshCount = 3;     // wall, floor and coin
+    static constexpr GLuint cellAttribute = 2;
+
+    GLuint vao = 0;
+    GLuint cellBuffer = 0;      // CellData of each kd-tree object
+    GLuint visibleBuffer = 0;   // meshCount ranges of cellCount visible cells
+    GLuint commandBuffer = 0;
+    GLsizei cellCount = 0;
+    DrawElementsIndirectCommand emptyCommands[meshCount];
+    QOpenGLShaderProgram cullPrg;
+    QOpenGLShaderProgram drawPrg;
+public:
+    // meshes are the wall, floor and coin mesh in the given vertex and index buffers
+    void init(const KdTree& tree, GLuint positionBuffer, GLuint normalBuffer, GLuint indexBuffer, const Mesh* meshes);
+    void destroy();
+
+    // uploads the cells of changed kd-tree objects
+    void updateCells(const KdTree& tree, const std::vector<int>& objects);
+    // fills the draw commands of one view; occlusion is only tested if the view has a valid pyramid
+    void cull(int view, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, bool frustumCulling,
+            const DepthPyramid& pyramid);
+    // draws the visible cells with the View uniform block that is currently bound
+    void draw(float coinTime);
 };
 
-void calcBorders(Node* root);
+// The coins that are left, in a storage buffer that only changes when coins are collected. The
+// vertex shader spins every coin from the coin time and its phase, so drawing all of them takes
+// one instanced draw call and no work per coin on the CPU.
+class CoinBuffer : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    GLuint buffer = 0;
+    GLuint visibleBuffer = 0;       // the coins of the next draw, as indices into buffer
+    GLsizei count = 0;
+    std::vector<int> objectSlots;   // per kd-tree object, its coin in the buffer or -1
+    std::vector<int> slotObjects;   // per coin, its kd-tree object
+    std::vector<GLuint> visibleSlots;
+    std::vector<int> slotDraws;     // per coin, the last draw it was added to
+    int draw = 1;
+public:
+    void init(const KdTree& tree);
+    void destroy();
 
-Node* kdTree(std::vector<RenderObject>& objects, int depth = 0);
-void pullUp(Node* node);
+    // removes the coins of changed kd-tree objects that are no longer coins
+    void update(const KdTree& tree, const std::vector<int>& objects);
+    GLuint storageBuffer() const { return buffer; }
+    GLsizei coinCount() const { return count; }
 
-template<typename Func>
-void frontToBack(Node* root, QVector3D eye, Func f)
-{
-    if (root == nullptr) return;
-
-    bool stop = f(root);
-    int axis = root->axis;
-    bool positive;
-    if (axis == 0) {
-        positive = eye.x() < root->border;
-    } else {
-        positive = eye.y() < root->border;
-    }
-    if (positive && !stop) {
-        frontToBack<Func>(root->left, eye, f);
-        frontToBack<Func>(root->right, eye, f);
-    } else if(!positive && !stop){
-        frontToBack<Func>(root->right, eye, f);
-        frontToBack<Func>(root->left, eye, f);
+    // adds the coin of a rendered kd-tree object, if it has one, to the next draw, at most once
+    void addVisible(int object)
+    {
+        int slot = objectSlots[object];
+        if (slot >= 0 && slotDraws[slot] != draw) {
+            slotDraws[slot] = draw;
+            visibleSlots.push_back(slot);
+        }
     }
-}
+    // uploads the coins added since the last call and returns their number
+    GLsizei uploadVisible();
+    GLuint visibleStorageBuffer() const { return visibleBuffer; }
+};
+
+// GPU slots for resident chunk meshes, all in one set of vertex and index buffers. Every slot
+// holds the largest possible chunk mesh, so a chunk is uploaded into any free slot and its slot
+// is reused once the chunk is evicted.
+class ChunkBuffers : protected QOpenGLFunctions_4_5_Core
+{
+private:
+    struct Slot
+    {
+        unsigned int firstIndex[gridCellTypes + 1];     // of the materials, see ChunkMesh
+    };
 
-template<typename Func>
-void inOrder(Node* root, Func f)
+    GLuint vao = 0;
+    GLuint buffers[3] = {};     // positions, normals and indices
+    std::vector<Slot> slots;
+    std::vector<int> freeSlots;
+    std::vector<int> chunkSlots;    // per chunk, -1 if it is not resident
+public:
+    void init(int chunkCount, int slotCount);
+    void destroy();
+
+    // uploads a chunk mesh into the slot of its chunk, or into a free one
+    void upload(const ChunkMesh& mesh);
+    void evict(int chunk);
+    bool resident(int chunk) const { return chunkSlots[chunk] >= 0; }
+    GLuint vertexArray() const { return vao; }
+    // the part of a resident chunk drawn with one material; its indexCount is 0 if there is none
+    Mesh mesh(int chunk, GridCell material) const;
+};
+
+// Framebuffer objects with depth textures for the views of all windows, created once and only
+// replaced when the size of a view changes. The color attachment is the view texture handed in
+// by QVR and is only reattached when that texture changes.
+class RenderTargets : protected QOpenGLFunctions_4_5_Core
 {
-    if (root == nullptr) return;
+private:
+    struct Target
+    {
+        QString window;
+        int view;
+        int width = 0;
+        int height = 0;
+        GLuint fbo = 0;
+        GLuint depthTexture = 0;    // immutable storage, so a new size needs a new texture
+        GLuint colorTexture = 0;    // the attached view texture, or the layers of a stereo target
+    };
 
-    inOrder<Func>(root->left, f);
-    f(root);
-    inOrder<Func>(root->right, f);
-}
+    std::vector<Target> targets;
+    GLuint resolveFbos[2] = {};     // read and draw framebuffers for copying stereo layers
 
-void freeTree(Node* root);
+    Target& target(const QString& window, int view);
+public:
+    void init();
+    void destroy();
+
+    // binds the target of a window view for drawing into colorTexture, resizing it if needed;
+    // returns its depth texture
+    GLuint bind(const QString& window, int view, int width, int height, GLuint colorTexture);
+    // binds a layered target of a window with one layer per eye, for single-pass stereo
+    void bindStereo(const QString& window, int width, int height);
+    // copies the layers of the stereo target of a window into the textures of its two views
+    void resolveStereo(const QString& window, const unsigned int* textures);
+};
 
 class MazeApp : public QVRApp, protected QOpenGLFunctions_4_5_Core
 {
@@ -228,24 +399,35 @@ private:
     QElapsedTimer _timer;       // used for rotating the box
 
     /* Static data for rendering, initialized per process. */
-    unsigned int _fbo;          // Framebuffer object to render into
-    unsigned int _fboDepthTex;  // Depth attachment for the FBO
-    unsigned int _vaoWall;          // Vertex array object for the box
-    unsigned int _vaoIndicesWall;   // Number of indices to render for the box
-    unsigned int _vaoFloor;
-    unsigned int _vaoIndicesFloor;
-    unsigned int _vaoCoin;
-    unsigned int _coinSize;
+    RenderTargets renderTargets;
+    unsigned int _fboDepthTex;  // Depth attachment of the render target of the current view
+    unsigned int _vao;          // Vertex array object for all meshes
+    Mesh _meshWall;
+    Mesh _meshFloor;
+    Mesh _meshCoin;
+    unsigned int _viewUniformBuf;   // ViewData of the view being rendered
+    unsigned int _stereoViewUniformBuf; // StereoViewData of both eyes in single-pass stereo
     QOpenGLShaderProgram _prg;  // Shader program for rendering
-    GridCell* mazeGrid;    // 0 = nothing, 1 = wall, 2 = finish, (3 = spawn)
+    QOpenGLShaderProgram _prgObjects;   // Shader program for objects from the object data buffer
+    QOpenGLShaderProgram _prgObjectsStereo; // the same for both eyes at once, into a layered target
+    QOpenGLShaderProgram _prgCoins;     // Shader program for the coins of the coin buffer
+    QOpenGLShaderProgram _prgCoinsStereo;   // the same for both eyes at once, into a layered target
+    GridCell* mazeGrid;    // the maze as loaded, but opened doors are empty; see MazeMesher::setCell
     size_t gridWidth;
     size_t gridHeight;
-    int coinsLeft = 0;
     float coinBoundingSphere = 0;
-    float coinRotation = 0.0f;
+    float coinTime = 0.0f;          // seconds of coin animation, wrapped at one turn
+    static constexpr float nearDistance = 0.05f;
+    static constexpr float farDistance = 100.0f;    // cells beyond are left out of the PVS
+    static_assert(farDistance <= 2.0f * PotentiallyVisibleSet::reach, "the PVS must reach the far plane");
     bool frustumCulling = false;
-    bool occlusionCullingCHC = false;
-    bool occlusionCulling = false; 
+    OcclusionMode occlusionMode = OcclusionMode::NONE;
+    bool instancedRendering = false;
+    bool mergedGeometry = false;    // walls and floors from the resident chunk meshes instead of one object per cell
+    bool singlePassStereo = false;  // both eyes of a window in one traversal and one set of draws
+    GLuint instanceViews = 1;       // views every flushed object is drawn to
+    bool nonBlockingReadback = false;
+    bool printStatistics = false;
     bool chcDebug = false;
     int debugLevel = 0;
     bool forwardPressed = false;
@@ -256,9 +438,84 @@ private:
     QVector2D mouseDx;
     QVector3D playerPosition;
     std::vector<RenderObject> renderQueue;
-    std::vector<OcclusionQuery*> vQueries;
-    std::vector<OcclusionQuery*> iQueries;
-    Node* kdTreeRoot;
+    OcclusionQueryPool queryPool;
+    std::vector<ChcView> chcViews;
+    int chcView = 0;                        // index of the view being rendered
+    std::vector<OcclusionQuery> iQueries;
+    std::minstd_rand chcRandom;
+    std::vector<int> chcStack;              // front-to-back traversal stack
+    std::vector<int> chcVisibleQueue;       // visible leaves waiting for their query
+    std::vector<int> chcInvisibleQueue;     // previously invisible nodes waiting for a (multi)query
+    std::vector<int> chcMultiQueryNodes;
+    std::deque<MultiQuery> chcQueryQueue;   // queries whose results are needed in this frame
+    int statisticsFrames = 0;
+    float statisticsSeconds = 0.0f;
+    unsigned int statisticsQueries = 0;
+    ObjectDataBuffer objectData;
+    std::vector<ObjectData> wallInstances;
+    std::vector<ObjectData> floorInstances;
+    KdTree kdTree;
+    std::vector<int> cellObjects;   // kd-tree object index of each grid cell, row by row
+    WorldState world;
+    std::vector<int> changedObjects;
+    DepthPyramid depthPyramid;
+    GpuCulling gpuCulling;
+    CoinBuffer coinBuffer;
+    std::vector<DepthLevel> hiZLevels;
+    std::deque<OcclusionRasterizer> rasterizers;    // software occlusion culling, per ChcView
+    std::vector<Bounds> occluderBoxes;
+    std::vector<bool> occluderCells;        // cells around the eye already in an occluder box
+    // state sent to the slave processes: a snapshot in the first frame, deltas afterwards
+    int syncFrame = 0;                      // frames updated by this process
+    std::vector<int> collectedCells;        // grid cells whose coins were collected in this frame
+    PotentiallyVisibleSet pvs;
+    PortalGraph portalGraph;
+    // Only the chunk meshes and the per-frame object data are bounded by the resident chunks; the
+    // mesher reads mazeGrid in place. The kd-tree, render queue, grid, cell objects, PVS, portal
+    // graph and the cell and coin buffers of the GPU mode still cover the whole maze and are
+    // built at startup.
+    static constexpr int streamRadius = 4;          // chunks around the player kept resident
+    static constexpr int maxResidentChunks = 128;   // at least (2 * streamRadius + 1)^2
+    ChunkStreamer chunkStreamer;
+    ChunkBuffers chunkBuffers;
+    std::vector<int> evictedChunks;
+    std::vector<ChunkMesh> loadedChunks;
+    std::vector<int> pendingChunks;     // chunks waiting for the next flushInstances
+    std::vector<int> chunkViews;        // per chunk, the last view it was drawn in
+    int chunkView = 0;
+
+    void setViewData(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix);
+    void drawObject(const RenderObject& object);
+    size_t pendingInstances() const;
+    void flushInstances();
+    // draws all coins after the maze, so the depth test rejects those behind walls
+    void drawCoins();
+    void appendInstances(const Mesh& mesh, std::vector<ObjectData>& instances, ObjectData*& data, GLuint& first,
+            DrawElementsIndirectCommand* commands, GLsizei& commandCount);
+    void toggleOcclusionMode(OcclusionMode mode);
+    void setOcclusionMode(OcclusionMode mode);
+    // tests the player against the cells around it and collects coins in reach; true on a wall hit
+    bool collide(const QVector3D& position);
+    // removes a coin and opens the doors once the last one is gone
+    void collectCoin(int object);
+    void openDoors();
+
+    // makes the query state and kd-tree visibility of a window view current
+    void selectChcView(const QString& window, int view);
+    // hands a leaf found visible in the current view to the other views of its window
+    void shareVisibility(int node);
+    void renderCHCPlusPlus(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye);
+    void traverseCHCPlusPlus(int node, const QVector3D& eye);
+    void issueVisibleQueries(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, size_t maxCount);
+    void issueMultiQueries(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix);
+    void renderHiZ(int width, int height, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix,
+            const QVector3D& eye);
+    void renderSoftwareOcclusion(float aspect, const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix,
+            const QVector3D& eye);
+    void renderPvs(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye);
+    void renderPortals(const QMatrix4x4& projectionMatrix, const QMatrix4x4& viewMatrix, const QVector3D& eye);
+    // renders both views of a stereo window in one pass, culled against the union of their frusta
+    void renderStereo(QVRWindow* w, const QVRRenderContext& context, const unsigned int* textures);
 
 public:
     MazeApp();
@@ -270,6 +527,8 @@ public:
 
     void update(const QList<QVRObserver*>& observers) override;
 
+    void getNearFar(float& nearPlane, float& farPlane) override;
+
     bool wantExit() override;
 
     void serializeDynamicData(QDataStream& ds) const override;
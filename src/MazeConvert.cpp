@@ -0,0 +1,34 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "MazeFile.hpp"
+#include "PotentiallyVisibleSet.hpp"
+
+// Converts a maze image into a level file with a precomputed PVS.
+// Usage: maze-convert maze.bmp maze.maze [--no-pvs]
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3 || (argc > 3 && std::string(argv[3]) != "--no-pvs")) {
+        std::cerr << "Usage: " << argv[0] << " maze.bmp maze.maze [--no-pvs]" << std::endl;
+        return 1;
+    }
+    bool withPvs = (argc == 3);
+
+    std::vector<GridCell> grid;
+    int gridWidth, gridHeight;
+    if (!readMazeImage(argv[1], grid, gridWidth, gridHeight)) {
+        std::cerr << "Could not load maze image " << argv[1] << std::endl;
+        return 1;
+    }
+    PotentiallyVisibleSet pvs;
+    if (withPvs) {
+        pvs.build(grid.data(), gridWidth, gridHeight, std::thread::hardware_concurrency());
+    }
+    if (!MazeFile::write(argv[2], grid.data(), gridWidth, gridHeight, withPvs ? &pvs : nullptr)) {
+        return 1;
+    }
+    std::cout << argv[2] << ": " << gridWidth << "x" << gridHeight << " cells" << std::endl;
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <cstring>
+#include <limits>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "MazeFile.hpp"
+#include "PotentiallyVisibleSet.hpp"
+
+
+namespace {
+
+uint64_t aligned(uint64_t offset)
+{
+    return (offset + 7) & ~uint64_t(7);
+}
+
+}
+
+bool MazeFile::open(const QString& fileName)
+{
+    close();
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    uint64_t size = file.size();
+    data = file.map(0, size);
+    if (!data || size < sizeof(MazeFileHeader)) {
+        qCritical("Could not map level file %s", qPrintable(fileName));
+        close();
+        return false;
+    }
+    header = reinterpret_cast<const MazeFileHeader*>(data);
+    uint64_t cellCount = uint64_t(header->width) * header->height;
+    bool valid = std::memcmp(header->magic, "MAZE", 4) == 0 && header->version == version
+        && cellCount <= uint64_t(std::numeric_limits<int>::max())
+        && header->cellsOffset <= size && (cellCount + 1) / 2 <= size - header->cellsOffset
+        && header->pvsOffset <= size && header->pvsSize <= size - header->pvsOffset;
+    // the cells are cast to GridCell as they are, so every one must be a valid type
+    for (uint64_t index = 0; valid && index < cellCount; index++) {
+        valid = cell(index) <= GridCell::DOOR;
+    }
+    if (!valid) {
+        qCritical("Invalid level file %s", qPrintable(fileName));
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MazeFile::close()
+{
+    if (data) {
+        file.unmap(const_cast<unsigned char*>(data));
+    }
+    data = nullptr;
+    header = nullptr;
+    file.close();
+}
+
+void MazeFile::unpack(GridCell* cells) const
+{
+    const unsigned char* pairs = data + header->cellsOffset;
+    int cellCount = width() * height();
+    for (int cell = 0; cell + 1 < cellCount; cell += 2) {
+        cells[cell] = static_cast<GridCell>(pairs[cell / 2] & 0x0f);
+        cells[cell + 1] = static_cast<GridCell>(pairs[cell / 2] >> 4);
+    }
+    if (cellCount % 2 != 0) {
+        cells[cellCount - 1] = cell(cellCount - 1);
+    }
+}
+
+bool MazeFile::loadPvs(PotentiallyVisibleSet& pvs) const
+{
+    if (header->pvsOffset == 0) return false;
+    return pvs.load(data + header->pvsOffset, header->pvsSize, width(), height());
+}
+
+bool MazeFile::write(const QString& fileName, const GridCell* grid, int gridWidth, int gridHeight,
+        const PotentiallyVisibleSet* pvs)
+{
+    int cellCount = gridWidth * gridHeight;
+    std::vector<unsigned char> pvsData;
+    if (pvs) {
+        pvs->save(pvsData);
+    }
+
+    MazeFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "MAZE", 4);
+    header.version = version;
+    header.width = gridWidth;
+    header.height = gridHeight;
+    header.cellsOffset = aligned(sizeof(header));
+    uint64_t end = header.cellsOffset + (cellCount + 1) / 2;
+    if (pvs) {
+        header.pvsOffset = aligned(end);
+        header.pvsSize = pvsData.size();
+        end = header.pvsOffset + header.pvsSize;
+    }
+
+    std::vector<unsigned char> data(end, 0);
+    std::memcpy(data.data(), &header, sizeof(header));
+    unsigned char* pairs = data.data() + header.cellsOffset;
+    for (int cell = 0; cell < cellCount; cell++) {
+        pairs[cell / 2] |= static_cast<unsigned char>(grid[cell]) << (cell % 2 == 0 ? 0 : 4);
+    }
+    if (pvs) {
+        std::memcpy(data.data() + header.pvsOffset, pvsData.data(), pvsData.size());
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)
+            || file.write(reinterpret_cast<const char*>(data.data()), data.size()) != (qint64)data.size()) {
+        qCritical("Could not write level file %s", qPrintable(fileName));
+        return false;
+    }
+    return true;
+}
+
+bool readMazeImage(const char* fileName, std::vector<GridCell>& grid, int& gridWidth, int& gridHeight)
+{
+    int channels;
+    unsigned char* mazeImage = stbi_load(fileName, &gridWidth, &gridHeight, &channels, 0);
+    if (!mazeImage) return false;
+    grid.assign(gridWidth * gridHeight, GridCell::EMPTY);
+    for (int cell = 0; cell < gridHeight * gridWidth; cell++) {
+        // map bmp color to cell type
+        bool red, green, blue;
+        red = mazeImage[channels*cell + 0];
+        green = mazeImage[channels * cell + 1];
+        blue = mazeImage[channels * cell + 2];
+
+        if (red && green && blue) {
+            grid[cell] = GridCell::EMPTY;
+        } else if (red && !green && !blue) {
+            grid[cell] = GridCell::WALL;
+        } else if (!red && green && !blue) {
+            grid[cell] = GridCell::FINISH;
+        } else if (!red && !green && !blue) {
+            grid[cell] = GridCell::SPAWN;
+        } else if (red && green && !blue) {
+            grid[cell] = GridCell::COIN;
+        } else if (!red && !green && blue) {
+            grid[cell] = GridCell::DOOR;
+        }
+    }
+    stbi_image_free(mazeImage);
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <QFile>
+#include <QString>
+
+#include "KdTree.hpp"
+
+class PotentiallyVisibleSet;
+
+// Level file header. All fields are in native byte order, and every section starts at a
+// multiple of 8 bytes.
+struct MazeFileHeader
+{
+    char magic[4];              // "MAZE"
+    uint32_t version;
+    uint32_t width, height;
+    uint64_t cellsOffset;       // row by row, two cells per byte, the first one in the low nibble
+    uint64_t pvsOffset;         // see PotentiallyVisibleSet::save(); 0 if the file has none
+    uint64_t pvsSize;
+};
+
+// A packed level file, mapped into memory instead of read and decoded. The cells need only be
+// widened from 4 bits, and a precomputed PVS replaces the ray tracing at startup.
+class MazeFile
+{
+private:
+    QFile file;
+    const unsigned char* data = nullptr;
+    const MazeFileHeader* header = nullptr;
+public:
+    static constexpr uint32_t version = 2;
+
+    ~MazeFile() { close(); }
+
+    // maps the file; false if it cannot be read or is not a valid level file, including cells
+    // that are no GridCell
+    bool open(const QString& fileName);
+    void close();
+
+    int width() const { return header->width; }
+    int height() const { return header->height; }
+    GridCell cell(int index) const
+    {
+        unsigned char pair = data[header->cellsOffset + index / 2];
+        return static_cast<GridCell>((index % 2 == 0) ? (pair & 0x0f) : (pair >> 4));
+    }
+    // widens all cells into width() * height() GridCells
+    void unpack(GridCell* cells) const;
+
+    // fills the PVS from the file; false if the file has none
+    bool loadPvs(PotentiallyVisibleSet& pvs) const;
+
+    // writes a level file; pvs is optional
+    static bool write(const QString& fileName, const GridCell* grid, int gridWidth, int gridHeight,
+            const PotentiallyVisibleSet* pvs);
+};
+
+// Reads a maze image: white => empty, red => wall, green => finish, black => spawn,
+// yellow => coin, blue => door. Returns false if the image cannot be loaded.
+bool readMazeImage(const char* fileName, std::vector<GridCell>& grid, int& gridWidth, int& gridHeight);
@@ -0,0 +1,164 @@
+#include <algorithm>
+
+#include "MazeMesher.hpp"
+
+
+// bound by reference in std::min
+constexpr int MazeMesher::chunkSize;
+
+void MazeMesher::init(GridCell* cells, int gridWidth, int gridHeight)
+{
+    width = gridWidth;
+    height = gridHeight;
+    chunkColumns = (width + chunkSize - 1) / chunkSize;
+    chunkRows = (height + chunkSize - 1) / chunkSize;
+    grid = cells;
+}
+
+bool MazeMesher::solid(int row, int col) const
+{
+    if (row < 0 || row >= height || col < 0 || col >= width) return false;
+    GridCell type = grid[row * width + col];
+    return type == GridCell::WALL || type == GridCell::DOOR;
+}
+
+void MazeMesher::setCell(int row, int col, GridCell type, std::vector<int>& changedChunks)
+{
+    GridCell& cell = grid[row * width + col];
+    if (material(cell) == material(type)) return;
+    cell = type;
+    // wall sides belong to the chunk of their wall, so the neighbours may gain or lose faces
+    const int neighbours[5][2] = { { 0, 0 }, { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    for (const auto& offset : neighbours) {
+        int r = row + offset[0];
+        int c = col + offset[1];
+        if (r >= 0 && r < height && c >= 0 && c < width
+                && std::find(changedChunks.begin(), changedChunks.end(), chunkOf(r, c)) == changedChunks.end()) {
+            changedChunks.push_back(chunkOf(r, c));
+        }
+    }
+}
+
+void MazeMesher::mesh(int chunk, ChunkMesh& mesh) const
+{
+    int rowMin = (chunk / chunkColumns) * chunkSize;
+    int colMin = (chunk % chunkColumns) * chunkSize;
+    int rows = std::min(chunkSize, height - rowMin);
+    int cols = std::min(chunkSize, width - colMin);
+
+    // quads are collected per material and concatenated at the end
+    std::vector<float> positions[gridCellTypes];
+    std::vector<float> normals[gridCellTypes];
+    // corners counter-clockwise seen from the side the normal points to
+    auto addQuad = [&](GridCell type, const float (&corners)[4][3], float nx, float ny, float nz) {
+        int m = static_cast<int>(material(type));
+        for (const auto& corner : corners) {
+            positions[m].insert(positions[m].end(), corner, corner + 3);
+            normals[m].insert(normals[m].end(), { nx, ny, nz });
+        }
+    };
+    // cell edges in world x/z, see the placement of the render objects
+    auto edgeX = [&](int col) { return -(float)width + 2.0f * col; };
+    auto edgeZ = [&](int row) { return (float)height - 2.0f * row; };
+
+    // Floors and wall tops: every cell has one upward face, at the floor or at the top of the
+    // wall. Each rectangle grows to the right first, then down as long as whole rows match.
+    std::vector<bool> merged(rows * cols, false);
+    auto type = [&](int r, int c) { return material(grid[(rowMin + r) * width + colMin + c]); };
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            if (merged[r * cols + c]) continue;
+            GridCell m = type(r, c);
+            int w = 1;
+            while (c + w < cols && !merged[r * cols + c + w] && type(r, c + w) == m) {
+                w++;
+            }
+            int h = 1;
+            for (bool grow = true; grow && r + h < rows; ) {
+                for (int i = 0; i < w && grow; i++) {
+                    grow = !merged[(r + h) * cols + c + i] && type(r + h, c + i) == m;
+                }
+                if (grow) {
+                    h++;
+                }
+            }
+            for (int i = 0; i < h; i++) {
+                std::fill(merged.begin() + (r + i) * cols + c, merged.begin() + (r + i) * cols + c + w, true);
+            }
+            float y = solid(rowMin + r, colMin + c) ? cellHeight : 0.0f;
+            float x0 = edgeX(colMin + c);
+            float x1 = edgeX(colMin + c + w);
+            float z0 = edgeZ(rowMin + r + h);
+            float z1 = edgeZ(rowMin + r);
+            addQuad(m, { { x0, y, z0 }, { x0, y, z1 }, { x1, y, z1 }, { x1, y, z0 } }, 0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    // Wall sides facing open cells or the outside, merged into strips of the same material
+    // along the line they lie on. direction 0/1 face -z/+z along a row, 2/3 face -x/+x along a
+    // column.
+    const int steps[4][2] = { { 1, 0 }, { -1, 0 }, { 0, -1 }, { 0, 1 } };
+    for (int direction = 0; direction < 4; direction++) {
+        bool alongRow = direction < 2;
+        int lines = alongRow ? rows : cols;
+        int length = alongRow ? cols : rows;
+        for (int line = 0; line < lines; line++) {
+            auto face = [&](int i) {
+                int r = rowMin + (alongRow ? line : i);
+                int c = colMin + (alongRow ? i : line);
+                return solid(r, c) && !solid(r + steps[direction][0], c + steps[direction][1]);
+            };
+            auto faceType = [&](int i) { return alongRow ? type(line, i) : type(i, line); };
+            for (int i = 0; i < length; i++) {
+                if (!face(i)) continue;
+                GridCell m = faceType(i);
+                int n = 1;
+                while (i + n < length && face(i + n) && faceType(i + n) == m) {
+                    n++;
+                }
+                if (alongRow) {
+                    float x0 = edgeX(colMin + i);
+                    float x1 = edgeX(colMin + i + n);
+                    if (direction == 0) {
+                        float z = edgeZ(rowMin + line + 1);
+                        addQuad(m, { { x1, 0.0f, z }, { x0, 0.0f, z }, { x0, cellHeight, z }, { x1, cellHeight, z } },
+                                0.0f, 0.0f, -1.0f);
+                    } else {
+                        float z = edgeZ(rowMin + line);
+                        addQuad(m, { { x0, 0.0f, z }, { x1, 0.0f, z }, { x1, cellHeight, z }, { x0, cellHeight, z } },
+                                0.0f, 0.0f, 1.0f);
+                    }
+                } else {
+                    float z0 = edgeZ(rowMin + i + n);
+                    float z1 = edgeZ(rowMin + i);
+                    if (direction == 2) {
+                        float x = edgeX(colMin + line);
+                        addQuad(m, { { x, 0.0f, z1 }, { x, cellHeight, z1 }, { x, cellHeight, z0 }, { x, 0.0f, z0 } },
+                                -1.0f, 0.0f, 0.0f);
+                    } else {
+                        float x = edgeX(colMin + line + 1);
+                        addQuad(m, { { x, 0.0f, z0 }, { x, cellHeight, z0 }, { x, cellHeight, z1 }, { x, 0.0f, z1 } },
+                                1.0f, 0.0f, 0.0f);
+                    }
+                }
+                i += n - 1;
+            }
+        }
+    }
+
+    mesh.chunk = chunk;
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+    for (int m = 0; m < gridCellTypes; m++) {
+        mesh.firstIndex[m] = mesh.indices.size();
+        unsigned int first = mesh.positions.size() / 3;
+        for (unsigned int quad = 0; quad < positions[m].size() / 12; quad++) {
+            unsigned int v = first + 4 * quad;
+            mesh.indices.insert(mesh.indices.end(), { v, v + 1, v + 2, v, v + 2, v + 3 });
+        }
+        mesh.positions.insert(mesh.positions.end(), positions[m].begin(), positions[m].end());
+        mesh.normals.insert(mesh.normals.end(), normals[m].begin(), normals[m].end());
+    }
+    mesh.firstIndex[gridCellTypes] = mesh.indices.size();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+
+#include "KdTree.hpp"
+
+// Merged geometry of one chunk in world space. Indices are relative to the first vertex of the
+// chunk and grouped by material: those of material m are [firstIndex[m], firstIndex[m + 1]).
+struct ChunkMesh
+{
+    int chunk = -1;
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<unsigned int> indices;
+    unsigned int firstIndex[gridCellTypes + 1];
+};
+
+// Static maze geometry, merged per square chunk of cells. Faces between neighbouring walls and
+// doors and the bottoms of walls are never seen and dropped. Coplanar faces of the same material
+// are merged: floors and wall tops into greedy rectangles, wall sides into strips along their row
+// or column. A changed cell only affects its own chunk and the chunks whose wall sides face it.
+class MazeMesher
+{
+private:
+    int width = 0;
+    int height = 0;
+    int chunkColumns = 0;
+    int chunkRows = 0;
+    GridCell* grid = nullptr;   // of the caller, written only by setCell
+
+    bool solid(int row, int col) const;
+public:
+    static constexpr int chunkSize = 8;     // cells along each side of a chunk
+    // bounds of any chunk mesh: one upward face per cell and at most four sides per wall
+    static constexpr int maxChunkVertices = chunkSize * chunkSize * 5 * 4;
+    static constexpr int maxChunkIndices = chunkSize * chunkSize * 5 * 6;
+
+    // meshes the cells in place instead of keeping a copy; they must outlive the mesher
+    void init(GridCell* cells, int gridWidth, int gridHeight);
+
+    // Changes a cell and appends the chunks whose mesh changed with it. Only changes of the
+    // material are written to the cells, so a collected coin stays a coin there.
+    void setCell(int row, int col, GridCell type, std::vector<int>& changedChunks);
+    void mesh(int chunk, ChunkMesh& mesh) const;
+
+    int chunkCount() const { return chunkColumns * chunkRows; }
+    int chunkColumnCount() const { return chunkColumns; }
+    int chunkRowCount() const { return chunkRows; }
+    int chunkOf(int row, int col) const { return (row / chunkSize) * chunkColumns + col / chunkSize; }
+
+    // the material a cell is meshed with; coin cells have an empty floor, the coin is drawn apart
+    static GridCell material(GridCell type) { return type == GridCell::COIN ? GridCell::EMPTY : type; }
+};
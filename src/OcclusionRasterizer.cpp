@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OCCLUSION_RASTERIZER_SSE
+#endif
+// AVX2 is compiled per function and chosen at run time, so the build needs no extra flags
+#if defined(OCCLUSION_RASTERIZER_SSE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OCCLUSION_RASTERIZER_AVX2
+#endif
+
+#include "OcclusionRasterizer.hpp"
+
+
+namespace {
+
+// the faces of a box with outward normals, counter-clockwise seen from outside; corner bit 0
+// selects xMax, bit 1 heightMax and bit 2 yMax
+const int boxFaces[6][4] = {
+    { 1, 3, 7, 5 }, { 0, 4, 6, 2 },     // +x, -x
+    { 2, 6, 7, 3 }, { 0, 1, 5, 4 },     // +height, -height
+    { 4, 5, 7, 6 }, { 0, 2, 3, 1 }      // +y, -y
+};
+
+// pixels with y up and depth in [0, 1]
+void windowCoordinates(const QVector4D& clip, int width, int height, float* window)
+{
+    float w = clip.w();
+    window[0] = (clip.x() / w * 0.5f + 0.5f) * width;
+    window[1] = (clip.y() / w * 0.5f + 0.5f) * height;
+    window[2] = clip.z() / w * 0.5f + 0.5f;
+}
+
+float cross(const float* o, const float* a, const float* b)
+{
+    return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+// counter-clockwise convex hull of the xy of 8 points (monotone chain); returns its size
+int convexHull(const float (*points)[3], float (*hull)[2])
+{
+    const float* sorted[8];
+    for (int i = 0; i < 8; i++) {
+        sorted[i] = points[i];
+    }
+    std::sort(sorted, sorted + 8, [](const float* a, const float* b) {
+        return a[0] < b[0] || (a[0] == b[0] && a[1] < b[1]);
+    });
+    const float* chain[16];
+    int k = 0;
+    for (int i = 0; i < 8; i++) {
+        while (k >= 2 && cross(chain[k - 2], chain[k - 1], sorted[i]) <= 0.0f) k--;
+        chain[k++] = sorted[i];
+    }
+    for (int i = 6, lower = k + 1; i >= 0; i--) {
+        while (k >= lower && cross(chain[k - 2], chain[k - 1], sorted[i]) <= 0.0f) k--;
+        chain[k++] = sorted[i];
+    }
+    // the last point repeats the first
+    for (int i = 0; i + 1 < k; i++) {
+        hull[i][0] = chain[i][0];
+        hull[i][1] = chain[i][1];
+    }
+    return std::max(k - 1, 0);
+}
+
+// edge functions and front face depth planes of a polygon, see rasterizePolygon
+struct PolygonSetup
+{
+    int edgeCount;
+    float ex[8], ey[8], e0[8];
+    int planeCount;
+    float zx[3], zy[3], z0[3], maxDepth[3];
+};
+
+// The fill functions write the pixels of rows yMin to yMax, columns xMin to xMax, whose edge
+// functions are all at least zero, keeping the nearer of the old depth and the farthest plane.
+#ifdef OCCLUSION_RASTERIZER_SSE
+// four pixels of a row at once; rows have a multiple of four pixels
+void fillSse(const PolygonSetup& setup, float* depth, int width, int xMin, int xMax, int yMin, int yMax)
+{
+    xMin &= ~3;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    __m128 stepE[8];
+    for (int i = 0; i < setup.edgeCount; i++) {
+        stepE[i] = _mm_set1_ps(4.0f * setup.ex[i]);
+    }
+    __m128 stepZ[3], maxZ[3];
+    for (int j = 0; j < setup.planeCount; j++) {
+        stepZ[j] = _mm_set1_ps(4.0f * setup.zx[j]);
+        maxZ[j] = _mm_set1_ps(setup.maxDepth[j]);
+    }
+    for (int y = yMin; y <= yMax; y++) {
+        float py = y + 0.5f;
+        __m128 px = _mm_add_ps(_mm_set1_ps((float)xMin), offsets);
+        __m128 e[8], z[3];
+        for (int i = 0; i < setup.edgeCount; i++) {
+            e[i] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(setup.ex[i]), px), _mm_set1_ps(setup.ey[i] * py + setup.e0[i]));
+        }
+        for (int j = 0; j < setup.planeCount; j++) {
+            z[j] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(setup.zx[j]), px), _mm_set1_ps(setup.zy[j] * py + setup.z0[j]));
+        }
+        float* row = depth + y * width;
+        for (int x = xMin; x <= xMax; x += 4) {
+            __m128 inside = _mm_cmpge_ps(e[0], zero);
+            for (int i = 1; i < setup.edgeCount; i++) {
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(e[i], zero));
+            }
+            if (_mm_movemask_ps(inside)) {
+                __m128 farthest = _mm_min_ps(z[0], maxZ[0]);
+                for (int j = 1; j < setup.planeCount; j++) {
+                    farthest = _mm_max_ps(farthest, _mm_min_ps(z[j], maxZ[j]));
+                }
+                __m128 old = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(old, farthest);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+            for (int i = 0; i < setup.edgeCount; i++) {
+                e[i] = _mm_add_ps(e[i], stepE[i]);
+            }
+            for (int j = 0; j < setup.planeCount; j++) {
+                z[j] = _mm_add_ps(z[j], stepZ[j]);
+            }
+        }
+    }
+}
+#else
+void fillScalar(const PolygonSetup& setup, float* depth, int width, int xMin, int xMax, int yMin, int yMax)
+{
+    for (int y = yMin; y <= yMax; y++) {
+        float py = y + 0.5f;
+        float* row = depth + y * width;
+        for (int x = xMin; x <= xMax; x++) {
+            float px = x + 0.5f;
+            bool inside = true;
+            for (int i = 0; i < setup.edgeCount && inside; i++) {
+                inside = setup.ex[i] * px + setup.ey[i] * py + setup.e0[i] >= 0.0f;
+            }
+            if (!inside) continue;
+            float farthest = 0.0f;
+            for (int j = 0; j < setup.planeCount; j++) {
+                farthest = std::max(farthest, std::min(setup.zx[j] * px + setup.zy[j] * py + setup.z0[j], setup.maxDepth[j]));
+            }
+            row[x] = std::min(row[x], farthest);
+        }
+    }
+}
+#endif
+
+#ifdef OCCLUSION_RASTERIZER_AVX2
+// the SSE fill with eight pixels at once; rows have a multiple of eight pixels
+__attribute__((target("avx2")))
+void fillAvx2(const PolygonSetup& setup, float* depth, int width, int xMin, int xMax, int yMin, int yMax)
+{
+    xMin &= ~7;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 offsets = _mm256_set_ps(7.5f, 6.5f, 5.5f, 4.5f, 3.5f, 2.5f, 1.5f, 0.5f);
+    __m256 stepE[8];
+    for (int i = 0; i < setup.edgeCount; i++) {
+        stepE[i] = _mm256_set1_ps(8.0f * setup.ex[i]);
+    }
+    __m256 stepZ[3], maxZ[3];
+    for (int j = 0; j < setup.planeCount; j++) {
+        stepZ[j] = _mm256_set1_ps(8.0f * setup.zx[j]);
+        maxZ[j] = _mm256_set1_ps(setup.maxDepth[j]);
+    }
+    for (int y = yMin; y <= yMax; y++) {
+        float py = y + 0.5f;
+        __m256 px = _mm256_add_ps(_mm256_set1_ps((float)xMin), offsets);
+        __m256 e[8], z[3];
+        for (int i = 0; i < setup.edgeCount; i++) {
+            e[i] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(setup.ex[i]), px), _mm256_set1_ps(setup.ey[i] * py + setup.e0[i]));
+        }
+        for (int j = 0; j < setup.planeCount; j++) {
+            z[j] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(setup.zx[j]), px), _mm256_set1_ps(setup.zy[j] * py + setup.z0[j]));
+        }
+        float* row = depth + y * width;
+        for (int x = xMin; x <= xMax; x += 8) {
+            __m256 inside = _mm256_cmp_ps(e[0], zero, _CMP_GE_OQ);
+            for (int i = 1; i < setup.edgeCount; i++) {
+                inside = _mm256_and_ps(inside, _mm256_cmp_ps(e[i], zero, _CMP_GE_OQ));
+            }
+            if (_mm256_movemask_ps(inside)) {
+                __m256 farthest = _mm256_min_ps(z[0], maxZ[0]);
+                for (int j = 1; j < setup.planeCount; j++) {
+                    farthest = _mm256_max_ps(farthest, _mm256_min_ps(z[j], maxZ[j]));
+                }
+                __m256 old = _mm256_loadu_ps(row + x);
+                __m256 nearest = _mm256_min_ps(old, farthest);
+                _mm256_storeu_ps(row + x, _mm256_blendv_ps(old, nearest, inside));
+            }
+            for (int i = 0; i < setup.edgeCount; i++) {
+                e[i] = _mm256_add_ps(e[i], stepE[i]);
+            }
+            for (int j = 0; j < setup.planeCount; j++) {
+                z[j] = _mm256_add_ps(z[j], stepZ[j]);
+            }
+        }
+    }
+}
+#endif
+
+}
+
+// The depth plane of a planar face given by its vertices in window coordinates; false for back
+// faces and faces seen edge-on.
+bool OcclusionRasterizer::depthPlane(const float* const* vertices, int count, DepthPlane& plane)
+{
+    float area = 0.0f;
+    plane.maxDepth = 0.0f;
+    for (int i = 0; i < count; i++) {
+        const float* p = vertices[i];
+        const float* q = vertices[(i + 1) % count];
+        area += p[0] * q[1] - q[0] * p[1];
+        plane.maxDepth = std::max(plane.maxDepth, p[2]);
+    }
+    if (area <= 0.0f) return false;
+
+    // the largest triangle of the fan gives the most accurate plane; a face that covers less
+    // than a pixel only bounds the depth by its farthest vertex
+    const float* a = vertices[0];
+    const float* b = nullptr;
+    const float* c = nullptr;
+    float largest = 0.0f;
+    for (int i = 1; i + 1 < count; i++) {
+        float triangle = cross(a, vertices[i], vertices[i + 1]);
+        if (triangle > largest) {
+            largest = triangle;
+            b = vertices[i];
+            c = vertices[i + 1];
+        }
+    }
+    if (largest < 1.0f) {
+        plane.zx = 0.0f;
+        plane.zy = 0.0f;
+        plane.z0 = plane.maxDepth;
+        return true;
+    }
+    plane.zx = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / largest;
+    plane.zy = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / largest;
+    plane.z0 = a[2] - plane.zx * a[0] - plane.zy * a[1] + 0.5f * (std::abs(plane.zx) + std::abs(plane.zy));
+    return true;
+}
+
+OcclusionRasterizer::~OcclusionRasterizer()
+{
+    invalidate();
+}
+
+void OcclusionRasterizer::start(std::vector<Bounds>& boxes, const QMatrix4x4& viewProjection, float aspect)
+{
+    invalidate();
+    occluders.swap(boxes);
+    viewProjectionMatrix = viewProjection;
+    width = depthWidth;
+    height = std::max((int)std::lround(depthWidth / aspect), 1);
+    worker = std::thread(&OcclusionRasterizer::run, this);
+}
+
+bool OcclusionRasterizer::finish()
+{
+    if (worker.joinable()) {
+        worker.join();
+        ready = true;
+    }
+    return ready;
+}
+
+void OcclusionRasterizer::invalidate()
+{
+    if (worker.joinable()) {
+        worker.join();
+    }
+    ready = false;
+}
+
+void OcclusionRasterizer::run()
+{
+    levels.resize(1);
+    levels[0].width = width;
+    levels[0].height = height;
+    levels[0].depth.assign(width * height, 1.0f);
+    for (const Bounds& box : occluders) {
+        rasterizeBox(box);
+    }
+    buildLevels();
+}
+
+void OcclusionRasterizer::rasterizeBox(const Bounds& box)
+{
+    QVector4D corners[8];
+    bool inFront = true;
+    for (int i = 0; i < 8; i++) {
+        corners[i] = viewProjectionMatrix * QVector4D((i & 1) ? box.xMax : box.xMin,
+                (i & 2) ? box.heightMax : box.heightMin, (i & 4) ? box.yMax : box.yMin, 1.0f);
+        inFront = inFront && corners[i].z() + corners[i].w() > 0.0f;
+    }
+
+    if (inFront) {
+        // The box is convex, so a ray enters it where it crosses the last of the front faces and
+        // the silhouette is the convex hull of the corners. One polygon leaves no cracks between
+        // the faces.
+        float window[8][3];
+        for (int i = 0; i < 8; i++) {
+            windowCoordinates(corners[i], width, height, window[i]);
+        }
+        DepthPlane planes[3];
+        int planeCount = 0;
+        for (const auto& face : boxFaces) {
+            const float* vertices[4] = { window[face[0]], window[face[1]], window[face[2]], window[face[3]] };
+            if (depthPlane(vertices, 4, planes[planeCount])) {
+                planeCount++;
+            }
+        }
+        float hull[8][2];
+        int hullCount = convexHull(window, hull);
+        if (planeCount > 0 && hullCount >= 3) {
+            rasterizePolygon(hull, hullCount, planes, planeCount);
+        }
+        return;
+    }
+
+    for (const auto& face : boxFaces) {
+        // clip against the near plane, z >= -w, which leaves at most five vertices
+        QVector4D polygon[5];
+        int count = 0;
+        for (int i = 0; i < 4; i++) {
+            const QVector4D& p = corners[face[i]];
+            const QVector4D& q = corners[face[(i + 1) % 4]];
+            float dp = p.z() + p.w();
+            float dq = q.z() + q.w();
+            if (dp >= 0.0f) {
+                polygon[count++] = p;
+            }
+            if ((dp >= 0.0f) != (dq >= 0.0f)) {
+                polygon[count++] = p + (q - p) * (dp / (dp - dq));
+            }
+        }
+        if (count < 3) continue;
+
+        float window[5][3];
+        const float* vertices[5];
+        float outline[5][2];
+        for (int i = 0; i < count; i++) {
+            windowCoordinates(polygon[i], width, height, window[i]);
+            vertices[i] = window[i];
+            outline[i][0] = window[i][0];
+            outline[i][1] = window[i][1];
+        }
+        // back faces lie behind the front faces of the same box
+        DepthPlane plane;
+        if (depthPlane(vertices, count, plane)) {
+            rasterizePolygon(outline, count, &plane, 1);
+        }
+    }
+}
+
+void OcclusionRasterizer::rasterizePolygon(const float (*vertices)[2], int count, const DepthPlane* planes, int planeCount)
+{
+    float xLow = vertices[0][0], xHigh = vertices[0][0];
+    float yLow = vertices[0][1], yHigh = vertices[0][1];
+    for (int i = 1; i < count; i++) {
+        xLow = std::min(xLow, vertices[i][0]);
+        xHigh = std::max(xHigh, vertices[i][0]);
+        yLow = std::min(yLow, vertices[i][1]);
+        yHigh = std::max(yHigh, vertices[i][1]);
+    }
+    int xMin = std::max((int)std::floor(xLow), 0);
+    int xMax = std::min((int)std::ceil(xHigh), width - 1);
+    int yMin = std::max((int)std::floor(yLow), 0);
+    int yMax = std::min((int)std::ceil(yHigh), height - 1);
+    if (xMin > xMax || yMin > yMax) return;
+
+    // Edge functions e = ex * x + ey * y + e0 at pixel centers, positive inside. e0 is lowered
+    // by the largest decrease within a pixel, so e >= 0 holds for the whole pixel.
+    PolygonSetup setup;
+    setup.edgeCount = count;
+    for (int i = 0; i < count; i++) {
+        const float* p = vertices[i];
+        const float* q = vertices[(i + 1) % count];
+        setup.ex[i] = p[1] - q[1];
+        setup.ey[i] = q[0] - p[0];
+        setup.e0[i] = p[0] * q[1] - p[1] * q[0] - 0.5f * (std::abs(setup.ex[i]) + std::abs(setup.ey[i]));
+    }
+    setup.planeCount = planeCount;
+    for (int j = 0; j < planeCount; j++) {
+        setup.zx[j] = planes[j].zx;
+        setup.zy[j] = planes[j].zy;
+        setup.z0[j] = planes[j].z0;
+        setup.maxDepth[j] = planes[j].maxDepth;
+    }
+    float* depth = levels[0].depth.data();
+#ifdef OCCLUSION_RASTERIZER_AVX2
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        fillAvx2(setup, depth, width, xMin, xMax, yMin, yMax);
+        return;
+    }
+#endif
+#ifdef OCCLUSION_RASTERIZER_SSE
+    fillSse(setup, depth, width, xMin, xMax, yMin, yMax);
+#else
+    fillScalar(setup, depth, width, xMin, xMax, yMin, yMax);
+#endif
+}
+
+void OcclusionRasterizer::buildLevels()
+{
+    // like compute-shader-depth-pyramid.glsl: the last row and column also cover an odd texel
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const DepthLevel& source = levels.back();
+        DepthLevel level;
+        level.width = std::max(source.width / 2, 1);
+        level.height = std::max(source.height / 2, 1);
+        level.depth.resize(level.width * level.height);
+        for (int y = 0; y < level.height; y++) {
+            int yLast = std::min(2 * y + 1 + (y == level.height - 1), source.height - 1);
+            for (int x = 0; x < level.width; x++) {
+                int xLast = std::min(2 * x + 1 + (x == level.width - 1), source.width - 1);
+                float maxDepth = 0.0f;
+                for (int sy = 2 * y; sy <= yLast; sy++) {
+                    for (int sx = 2 * x; sx <= xLast; sx++) {
+                        maxDepth = std::max(maxDepth, source.depth[sy * source.width + sx]);
+                    }
+                }
+                level.depth[y * level.width + x] = maxDepth;
+            }
+        }
+        levels.push_back(std::move(level));
+    }
+}
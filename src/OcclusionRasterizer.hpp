@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+
+#include "KdTree.hpp"
+
+// Software occlusion culling. Wall boxes are rasterized into a small depth buffer on a worker
+// thread, which also builds a maximum depth pyramid from it with the layout of DepthPyramid.
+// Rasterization is conservative towards the inside: only pixels that a box covers completely
+// are written, with the farthest depth the box has within the pixel.
+// Kd-tree nodes are then tested against the boxes with hiZOccluded, without any GL work or
+// readback. The depth is kept with the view-projection matrix it was rasterized with, so a
+// result can be used for the camera of the next frame.
+class OcclusionRasterizer
+{
+private:
+    static constexpr int depthWidth = 256;  // a multiple of the SIMD width, 8 with AVX2
+
+    int width = 0;
+    int height = 0;
+    std::vector<Bounds> occluders;
+    QMatrix4x4 viewProjectionMatrix;
+    std::vector<DepthLevel> levels;     // the finest level is the depth buffer
+    std::thread worker;
+    bool ready = false;
+
+    // Window depth of a front face as z = zx * x + zy * y + z0, where z0 already includes the
+    // largest increase within a pixel, so z is the farthest depth of the plane in the pixel
+    // around (x, y). The face itself never reaches beyond maxDepth.
+    struct DepthPlane
+    {
+        float zx, zy, z0;
+        float maxDepth;
+    };
+
+    static bool depthPlane(const float* const* vertices, int count, DepthPlane& plane);
+    void run();
+    void rasterizeBox(const Bounds& box);
+    // fills the pixels completely inside a convex counter-clockwise polygon, at most 8 vertices
+    // in window coordinates, with the farthest depth of the given front faces
+    void rasterizePolygon(const float (*vertices)[2], int count, const DepthPlane* planes, int planeCount);
+    void buildLevels();
+public:
+    ~OcclusionRasterizer();
+
+    // Rasterizes the boxes on the worker thread; the boxes are taken over. aspect is the width
+    // of the view divided by its height.
+    void start(std::vector<Bounds>& boxes, const QMatrix4x4& viewProjectionMatrix, float aspect);
+    // waits for the worker; returns false if there is no result to test against
+    bool finish();
+    // waits for the worker and drops its result, e.g. after the world changed
+    void invalidate();
+
+    bool occluded(const Bounds& bounds) const { return hiZOccluded(bounds, viewProjectionMatrix, levels); }
+};
@@ -0,0 +1,166 @@
+#include <algorithm>
+
+#include "PortalGraph.hpp"
+
+
+namespace {
+
+// slack of the wedge sides in world units, so that portals seen exactly along a side stay visible
+constexpr float wedgeSlack = 1e-4f;
+
+bool isOpen(GridCell cell)
+{
+    return cell != GridCell::WALL && cell != GridCell::DOOR;
+}
+
+}
+
+void PortalGraph::build(const GridCell* grid, int gridWidth, int gridHeight)
+{
+    width = gridWidth;
+    height = gridHeight;
+    cellRegions.assign(width * height, -1);
+    regions.clear();
+    portals.clear();
+    cells.clear();
+
+    // greedy rectangles: grow each one to the right first, then down as long as whole rows fit
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            int cell = row * width + col;
+            if (cellRegions[cell] >= 0 || grid[cell] == GridCell::WALL) continue;
+            Region region = { row, col, 1, 1, -1, 0, 0, 0, 0 };
+            if (grid[cell] == GridCell::DOOR) {
+                region.door = cell;
+            } else {
+                auto free = [&](int r, int c) {
+                    return isOpen(grid[r * width + c]) && cellRegions[r * width + c] < 0;
+                };
+                while (col + region.cols < width && free(row, col + region.cols)) {
+                    region.cols++;
+                }
+                for (;;) {
+                    int nextRow = row + region.rows;
+                    if (nextRow >= height) break;
+                    int c = col;
+                    while (c < col + region.cols && free(nextRow, c)) {
+                        c++;
+                    }
+                    if (c < col + region.cols) break;
+                    region.rows++;
+                }
+            }
+            for (int r = row; r < row + region.rows; r++) {
+                for (int c = col; c < col + region.cols; c++) {
+                    cellRegions[r * width + c] = regions.size();
+                }
+            }
+            regions.push_back(region);
+        }
+    }
+
+    // cell edges in world x/z, see the placement of the render objects
+    auto edgeX = [&](int col) { return -(float)width + 2.0f * col; };
+    auto edgeY = [&](int row) { return (float)height - 2.0f * row; };
+    for (size_t i = 0; i < regions.size(); i++) {
+        Region& region = regions[i];
+        region.firstCell = cells.size();
+        for (int r = region.rowMin; r < region.rowMin + region.rows; r++) {
+            for (int c = region.colMin; c < region.colMin + region.cols; c++) {
+                cells.push_back(r * width + c);
+            }
+        }
+
+        // Walks the cells next to one side, starting at the corner startX/startY. Runs of cells
+        // in the same region become portals; walls and doors are drawn with this region.
+        region.firstPortal = portals.size();
+        auto side = [&](int count, int firstRow, int firstCol, int stepRow, int stepCol,
+                float startX, float startY, float normalX, float normalY) {
+            if (firstRow < 0 || firstRow + (count - 1) * stepRow >= height
+                    || firstCol < 0 || firstCol + (count - 1) * stepCol >= width) return;
+            auto neighbour = [&](int n) { return (firstRow + n * stepRow) * width + firstCol + n * stepCol; };
+            int runStart = 0;
+            for (int n = 0; n <= count; n++) {
+                int next = -1;
+                if (n < count) {
+                    next = cellRegions[neighbour(n)];
+                    if (!isOpen(grid[neighbour(n)])) {
+                        cells.push_back(neighbour(n));
+                    }
+                }
+                int previous = (n > 0) ? cellRegions[neighbour(n - 1)] : -1;
+                if (n == 0 || next == previous) continue;
+                if (previous >= 0) {
+                    portals.push_back(Portal { previous,
+                            startX + 2.0f * runStart * stepCol, startY - 2.0f * runStart * stepRow,
+                            startX + 2.0f * n * stepCol, startY - 2.0f * n * stepRow, normalX, normalY });
+                }
+                runStart = n;
+            }
+        };
+        int rowEnd = region.rowMin + region.rows;
+        int colEnd = region.colMin + region.cols;
+        side(region.cols, region.rowMin - 1, region.colMin, 0, 1, edgeX(region.colMin), edgeY(region.rowMin), 0.0f, 1.0f);
+        side(region.cols, rowEnd, region.colMin, 0, 1, edgeX(region.colMin), edgeY(rowEnd), 0.0f, -1.0f);
+        side(region.rows, region.rowMin, region.colMin - 1, 1, 0, edgeX(region.colMin), edgeY(region.rowMin), -1.0f, 0.0f);
+        side(region.rows, region.rowMin, colEnd, 1, 0, edgeX(colEnd), edgeY(region.rowMin), 1.0f, 0.0f);
+        region.portalEnd = portals.size();
+        region.cellEnd = cells.size();
+    }
+
+    onPath.assign(regions.size(), false);
+    visitedTraversal.assign(width * height, traversal);
+}
+
+bool PortalGraph::enter(const Portal& portal)
+{
+    // the part of the portal inside the wedge, relative to the eye
+    float ax = portal.x0 - eyeX;
+    float ay = portal.y0 - eyeY;
+    float bx = portal.x1 - eyeX;
+    float by = portal.y1 - eyeY;
+    float tMin = 0.0f;
+    float tMax = 1.0f;
+    for (const WedgeSide& side : wedge) {
+        float da = side.x * ax + side.y * ay + wedgeSlack;
+        float db = side.x * bx + side.y * by + wedgeSlack;
+        if (da < 0.0f && db < 0.0f) return false;
+        if (da < 0.0f) {
+            tMin = std::max(tMin, da / (da - db));
+        } else if (db < 0.0f) {
+            tMax = std::min(tMax, da / (da - db));
+        }
+    }
+    if (tMin > tMax) return false;
+    float clippedAx = ax + tMin * (bx - ax);
+    float clippedAy = ay + tMin * (by - ay);
+    float clippedBx = ax + tMax * (bx - ax);
+    float clippedBy = ay + tMax * (by - ay);
+
+    if (frustum) {
+        // the opening spans the full height of the walls
+        Bounds bounds;
+        bounds.xMin = std::min(clippedAx, clippedBx) + eyeX;
+        bounds.xMax = std::max(clippedAx, clippedBx) + eyeX;
+        bounds.yMin = std::min(clippedAy, clippedBy) + eyeY;
+        bounds.yMax = std::max(clippedAy, clippedBy) + eyeY;
+        bounds.heightMin = 0.0f;
+        bounds.heightMax = cellHeight;
+        if (!intersectsFrustum(bounds, frustum)) return false;
+    }
+
+    float lengthA = std::sqrt(clippedAx * clippedAx + clippedAy * clippedAy);
+    float lengthB = std::sqrt(clippedBx * clippedBx + clippedBy * clippedBy);
+    float cross = clippedAx * clippedBy - clippedAy * clippedBx;
+    if (std::abs(cross) <= 1e-3f * lengthA * lengthB) {
+        // The eye lies on the line of the portal, e.g. while crossing from one region into the
+        // next; everything beyond the line may be seen.
+        wedge.push_back(WedgeSide { portal.normalX, portal.normalY });
+        return true;
+    }
+    // sides through both ends of the clipped portal, facing each other
+    float sign = (cross > 0.0f) ? 1.0f : -1.0f;
+    wedge.push_back(WedgeSide { -sign * clippedAy / lengthA, sign * clippedAx / lengthA });
+    wedge.push_back(WedgeSide { sign * clippedBy / lengthB, -sign * clippedBx / lengthB });
+    return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+
+#include "KdTree.hpp"
+
+// Cells and portals over the maze grid. Open cells are merged into rectangles, which are convex,
+// and the openings between neighbouring rectangles become portals. Every door cell is a region
+// of its own that is entered only while the door is open. The view is traced through the
+// portals from the eye's region, narrowing a 2D wedge at each of them; walls span the full
+// height of the scene, so this is exact for an eye below the top of the walls.
+// Portals are kept in world x/z like Bounds.
+class PortalGraph
+{
+private:
+    struct Region
+    {
+        int rowMin, colMin;
+        int rows, cols;
+        int door;                       // grid cell of a door region, -1 for the others
+        size_t firstPortal, portalEnd;
+        size_t firstCell, cellEnd;
+    };
+    struct Portal
+    {
+        int region;                     // the region behind the portal
+        float x0, y0, x1, y1;
+        float normalX, normalY;         // points into the region behind
+    };
+    // side of the view wedge through the eye; points p with normal * (p - eye) >= 0 are inside
+    struct WedgeSide
+    {
+        float x, y;
+    };
+
+    int width = 0;
+    int height = 0;
+    std::vector<int> cellRegions;       // row by row, -1 for walls
+    std::vector<Region> regions;
+    std::vector<Portal> portals;
+    std::vector<int> cells;             // per region: its cells and the walls and doors around it
+    // traversal state
+    float eyeX = 0.0f;
+    float eyeY = 0.0f;
+    const QVector4D* frustum = nullptr;
+    std::vector<WedgeSide> wedge;       // sides added by the portals on the current path
+    std::vector<bool> onPath;
+    std::vector<int> visitedTraversal;  // per cell, the last traversal that visited it
+    int traversal = 0;
+
+    // clips the portal to the wedge and the frustum; if anything is left, adds its sides to the wedge
+    bool enter(const Portal& portal);
+
+    template<typename DoorOpen, typename Visit>
+    void visitRegion(int region, DoorOpen& doorOpen, Visit& visit)
+    {
+        const Region& r = regions[region];
+        for (size_t i = r.firstCell; i < r.cellEnd; i++) {
+            if (visitedTraversal[cells[i]] != traversal) {
+                visitedTraversal[cells[i]] = traversal;
+                visit(cells[i]);
+            }
+        }
+        onPath[region] = true;
+        for (size_t i = r.firstPortal; i < r.portalEnd; i++) {
+            const Portal& portal = portals[i];
+            const Region& next = regions[portal.region];
+            if (onPath[portal.region] || (next.door >= 0 && !doorOpen(next.door))) continue;
+            size_t sides = wedge.size();
+            if (enter(portal)) {
+                visitRegion(portal.region, doorOpen, visit);
+            }
+            wedge.resize(sides);
+        }
+        onPath[region] = false;
+    }
+public:
+    void build(const GridCell* grid, int gridWidth, int gridHeight);
+
+    size_t regionCount() const { return regions.size(); }
+    size_t portalCount() const { return portals.size() / 2; }
+
+    // Calls visit(cell) once for every grid cell seen from the eye at world x/z, including the
+    // walls and doors around the regions entered. doorOpen(cell) tells whether a door can be
+    // looked through. planes are optional frustum planes that each portal must intersect.
+    // Returns false without visiting anything if the eye is not inside an open region.
+    template<typename DoorOpen, typename Visit>
+    bool traverse(float x, float y, const QVector4D* planes, DoorOpen doorOpen, Visit visit)
+    {
+        int row = std::floor((height - y) / 2.0f);
+        int col = std::floor((x + width) / 2.0f);
+        if (row < 0 || row >= height || col < 0 || col >= width) return false;
+        int region = cellRegions[row * width + col];
+        if (region < 0 || (regions[region].door >= 0 && !doorOpen(regions[region].door))) return false;
+        eyeX = x;
+        eyeY = y;
+        frustum = planes;
+        wedge.clear();
+        traversal++;
+        visitRegion(region, doorOpen, visit);
+        return true;
+    }
+};
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+#include "PotentiallyVisibleSet.hpp"
+
+
+// bound by reference in std::min
+constexpr float PotentiallyVisibleSet::reach;
+
+namespace {
+
+constexpr int edgeSamples = 4;      // ray origins per cell edge
+constexpr float pi = 3.14159265358979f;
+
+// per-cell flags while tracing
+constexpr unsigned char SEEN_CLOSED = 1;    // reached without passing a door
+constexpr unsigned char SEEN_OPEN = 2;      // reached when doors are open
+
+struct VisibleCell
+{
+    int index;
+    unsigned char flags;
+};
+
+// Traces the cells visible from the cell at index. seen is all zero before and after the call.
+void traceCell(const GridCell* grid, int width, int height, int index, std::vector<unsigned char>& seen,
+        std::vector<VisibleCell>& visible)
+{
+    // A sightline from inside the cell leaves it through its border, so rays from points on the
+    // border see everything. Rays are less than half a cell apart where they end, at the reach
+    // or the far corner of the maze. The grid is traced with x along the columns and y along the rows.
+    int row = index / width;
+    int col = index % width;
+    float rayLength = std::min(PotentiallyVisibleSet::reach, (float)std::max(width, height));
+    int rayCount = std::ceil(8.0f * pi * rayLength);
+    std::vector<int> touched;
+    auto mark = [&](int cell, unsigned char flags) {
+        if (!seen[cell]) {
+            touched.push_back(cell);
+        }
+        seen[cell] |= flags;
+    };
+    mark(index, SEEN_CLOSED | SEEN_OPEN);
+    for (int sample = 0; sample < 4 * edgeSamples; sample++) {
+        float t = (float)(sample % edgeSamples) / edgeSamples;
+        float originX, originY;
+        switch (sample / edgeSamples) {
+        case 0:  originX = col + t;        originY = row;            break;
+        case 1:  originX = col + 1.0f;     originY = row + t;        break;
+        case 2:  originX = col + 1.0f - t; originY = row + 1.0f;     break;
+        default: originX = col;            originY = row + 1.0f - t; break;
+        }
+        for (int ray = 0; ray < rayCount; ray++) {
+            float angle = 2.0f * pi * (ray + 0.5f) / rayCount;
+            float dx = std::cos(angle);
+            float dy = std::sin(angle);
+            // cell by cell traversal, see Amanatides & Woo
+            int x = col;
+            int y = row;
+            int stepX = (dx > 0.0f) ? 1 : -1;
+            int stepY = (dy > 0.0f) ? 1 : -1;
+            float tMaxX = (dx != 0.0f) ? ((dx > 0.0f ? x + 1 : x) - originX) / dx : std::numeric_limits<float>::infinity();
+            float tMaxY = (dy != 0.0f) ? ((dy > 0.0f ? y + 1 : y) - originY) / dy : std::numeric_limits<float>::infinity();
+            float tDeltaX = std::abs(1.0f / dx);
+            float tDeltaY = std::abs(1.0f / dy);
+            bool throughDoor = false;
+            for (;;) {
+                // the ray enters the next cell at the smaller of the two
+                if (std::min(tMaxX, tMaxY) > rayLength) break;
+                if (tMaxX < tMaxY) {
+                    x += stepX;
+                    tMaxX += tDeltaX;
+                } else {
+                    y += stepY;
+                    tMaxY += tDeltaY;
+                }
+                if (x < 0 || x >= width || y < 0 || y >= height) break;
+                int cell = y * width + x;
+                mark(cell, throughDoor ? SEEN_OPEN : (SEEN_CLOSED | SEEN_OPEN));
+                if (grid[cell] == GridCell::WALL) break;
+                if (grid[cell] == GridCell::DOOR) {
+                    throughDoor = true;
+                }
+            }
+        }
+    }
+    visible.clear();
+    for (int cell : touched) {
+        visible.push_back(VisibleCell { cell, seen[cell] });
+        seen[cell] = 0;
+    }
+}
+
+}
+
+void PotentiallyVisibleSet::build(const GridCell* grid, int gridWidth, int gridHeight, unsigned int threads)
+{
+    width = gridWidth;
+    height = gridHeight;
+    int cellCount = width * height;
+    doors = std::count(grid, grid + cellCount, GridCell::DOOR);
+
+    // cells are traced independently; each thread takes every threads-th cell
+    std::vector<std::vector<VisibleCell>> visible(cellCount);
+    auto traceCells = [&](int first, int step) {
+        std::vector<unsigned char> seen(cellCount, 0);
+        for (int cell = first; cell < cellCount; cell += step) {
+            if (grid[cell] != GridCell::WALL) {
+                traceCell(grid, width, height, cell, seen, visible[cell]);
+            }
+        }
+    };
+    if (threads == 0) {
+        threads = 1;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++) {
+        workers.emplace_back(traceCells, t, threads);
+    }
+    traceCells(0, threads);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // Visibility between open cells is mutual, so a cell one set misses between two rays is
+    // taken from the set of the other cell.
+    std::vector<std::vector<VisibleCell>> mutual(cellCount);
+    for (int cell = 0; cell < cellCount; cell++) {
+        for (const VisibleCell& other : visible[cell]) {
+            if (grid[other.index] != GridCell::WALL && other.index != cell) {
+                mutual[other.index].push_back(VisibleCell { cell, other.flags });
+            }
+        }
+    }
+
+    // pack each set into a bitset over its bounding rectangle; the cells seen with open doors
+    // include those seen with closed doors
+    std::vector<unsigned char> seen(cellCount, 0);
+    sets.assign(cellCount, CellSet { 0, 0, 0, 0, 0 });
+    bits.clear();
+    for (int cell = 0; cell < cellCount; cell++) {
+        if (grid[cell] == GridCell::WALL) continue;
+        std::vector<VisibleCell>& cells = visible[cell];
+        cells.insert(cells.end(), mutual[cell].begin(), mutual[cell].end());
+        int rowMin = height, rowMax = -1, colMin = width, colMax = -1;
+        for (const VisibleCell& other : cells) {
+            seen[other.index] |= other.flags;
+            rowMin = std::min(rowMin, other.index / width);
+            rowMax = std::max(rowMax, other.index / width);
+            colMin = std::min(colMin, other.index % width);
+            colMax = std::max(colMax, other.index % width);
+        }
+        CellSet& set = sets[cell];
+        set.rowMin = rowMin;
+        set.colMin = colMin;
+        set.rows = rowMax - rowMin + 1;
+        set.cols = colMax - colMin + 1;
+        set.first = bits.size();
+        size_t words = wordCount(set);
+        bits.resize(bits.size() + 2 * words, 0);
+        uint32_t* closedBits = bits.data() + set.first;
+        uint32_t* openBits = closedBits + words;
+        for (const VisibleCell& other : cells) {
+            int i = (other.index / width - rowMin) * set.cols + other.index % width - colMin;
+            if (seen[other.index] & SEEN_CLOSED) {
+                closedBits[i / 32] |= 1u << (i % 32);
+            }
+            openBits[i / 32] |= 1u << (i % 32);
+            seen[other.index] = 0;
+        }
+        std::vector<VisibleCell>().swap(cells);
+    }
+}
+
+void PotentiallyVisibleSet::save(std::vector<unsigned char>& data) const
+{
+    uint64_t counts[2] = { doors, bits.size() };
+    data.clear();
+    data.insert(data.end(), reinterpret_cast<const unsigned char*>(counts),
+            reinterpret_cast<const unsigned char*>(counts + 2));
+    data.insert(data.end(), reinterpret_cast<const unsigned char*>(sets.data()),
+            reinterpret_cast<const unsigned char*>(sets.data() + sets.size()));
+    data.insert(data.end(), reinterpret_cast<const unsigned char*>(bits.data()),
+            reinterpret_cast<const unsigned char*>(bits.data() + bits.size()));
+}
+
+bool PotentiallyVisibleSet::load(const unsigned char* data, size_t size, int gridWidth, int gridHeight)
+{
+    uint64_t counts[2];
+    size_t cellCount = gridWidth * gridHeight;
+    if (size < sizeof(counts) + cellCount * sizeof(CellSet)) return false;
+    std::memcpy(counts, data, sizeof(counts));
+    size_t wordBytes = size - sizeof(counts) - cellCount * sizeof(CellSet);
+    if (counts[1] != wordBytes / sizeof(uint32_t) || wordBytes % sizeof(uint32_t) != 0) return false;
+    const unsigned char* setData = data + sizeof(counts);
+    std::vector<CellSet> loadedSets(cellCount);
+    std::memcpy(loadedSets.data(), setData, cellCount * sizeof(CellSet));
+
+    // every set must lie inside the grid and its two bitsets inside the words
+    for (const CellSet& set : loadedSets) {
+        if (set.rows == 0) continue;
+        if (set.rows < 0 || set.cols <= 0 || set.rowMin < 0 || set.colMin < 0
+                || set.rows > gridHeight - set.rowMin || set.cols > gridWidth - set.colMin
+                || set.first > counts[1] || 2 * wordCount(set) > counts[1] - set.first) {
+            return false;
+        }
+    }
+    width = gridWidth;
+    height = gridHeight;
+    doors = counts[0];
+    sets.swap(loadedSets);
+    bits.resize(counts[1]);
+    std::memcpy(bits.data(), setData + cellCount * sizeof(CellSet), counts[1] * sizeof(uint32_t));
+    return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "KdTree.hpp"
+
+// Cells visible from anywhere inside each open grid cell within the reach of the view, computed
+// once per maze. Walls block the view; doors are portals, so every cell keeps two sets: the cells
+// seen with all doors closed and those seen with all doors open. A set is stored as a bitset over
+// the bounding rectangle of the cells in it, which stays small in a maze.
+// The sets are traced from a finite number of sampled rays in the plane of the grid, so they are
+// approximate: a cell seen only through a gap narrower than the ray spacing may be missing, and
+// an eye above or below the walls sees past them.
+class PotentiallyVisibleSet
+{
+private:
+    struct CellSet
+    {
+        int rowMin, colMin;
+        int rows, cols;     // 0 for cells without a set
+        size_t first;       // word of the closed doors bitset; the open doors bitset follows
+    };
+
+    int width = 0;
+    int height = 0;
+    size_t doors = 0;
+    std::vector<CellSet> sets;      // row by row
+    std::vector<uint32_t> bits;
+
+    static size_t wordCount(const CellSet& set) { return (set.rows * set.cols + 31) / 32; }
+public:
+    // cells a sightline is traced through from the border of a cell; the far plane of MazeApp
+    // lies within it, so cells beyond are never drawn
+    static constexpr float reach = 52.0f;
+
+    // traces the sets of all open cells, spread across threads
+    void build(const GridCell* grid, int gridWidth, int gridHeight, unsigned int threads = 1);
+
+    // The sets as stored in a level file, in native byte order: the door count, the number of
+    // bitset words, the set of every cell and the bitsets. load() returns false if the data
+    // does not fit a grid of the given size.
+    void save(std::vector<unsigned char>& data) const;
+    bool load(const unsigned char* data, size_t size, int gridWidth, int gridHeight);
+
+    bool empty() const { return sets.empty(); }
+
+    // false for walls and positions outside the maze, which have no set
+    bool covers(int row, int col) const
+    {
+        return row >= 0 && row < height && col >= 0 && col < width && sets[row * width + col].rows > 0;
+    }
+    // number of doors in the maze the sets were built for
+    size_t doorCount() const { return doors; }
+
+    // calls f(row, col) for every cell visible from the given one
+    template<typename Func>
+    void forEachVisible(int row, int col, bool doorsOpen, Func f) const
+    {
+        const CellSet& set = sets[row * width + col];
+        const uint32_t* setBits = bits.data() + set.first + (doorsOpen ? wordCount(set) : 0);
+        int count = set.rows * set.cols;
+        for (int word = 0; word * 32 < count; word++) {
+            if (setBits[word] == 0) continue;
+            for (int bit = 0; bit < 32 && word * 32 + bit < count; bit++) {
+                if (setBits[word] & (1u << bit)) {
+                    int i = word * 32 + bit;
+                    f(set.rowMin + i / set.cols, set.colMin + i % set.cols);
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,58 @@
+#include "WorldState.hpp"
+
+
+void WorldState::init(KdTree& kdTree)
+{
+    tree = &kdTree;
+    for (auto& objects : typeObjects) {
+        objects.clear();
+    }
+    int objectCount = tree->objects.size();
+    typeSlots.resize(objectCount);
+    leaves.resize(objectCount);
+    changedObjects.clear();
+    changed.assign(objectCount, false);
+
+    for (int object = 0; object < objectCount; object++) {
+        auto& objects = typeObjects[static_cast<int>(type(object))];
+        typeSlots[object] = objects.size();
+        objects.push_back(object);
+    }
+    for (int node = 0; node < tree->size(); node++) {
+        if (tree->isLeaf(node)) {
+            leaves[tree->nodes[node].child] = node;
+        }
+    }
+}
+
+void WorldState::setType(int object, GridCell newType)
+{
+    GridCell oldType = type(object);
+    if (oldType == newType) return;
+
+    // swap-remove from the old list
+    auto& oldObjects = typeObjects[static_cast<int>(oldType)];
+    int slot = typeSlots[object];
+    oldObjects[slot] = oldObjects.back();
+    typeSlots[oldObjects[slot]] = slot;
+    oldObjects.pop_back();
+    auto& newObjects = typeObjects[static_cast<int>(newType)];
+    typeSlots[object] = newObjects.size();
+    newObjects.push_back(object);
+
+    tree->objects[object].type = newType;
+    refitBounds(*tree, leaves[object]);
+    if (!changed[object]) {
+        changed[object] = true;
+        changedObjects.push_back(object);
+    }
+}
+
+void WorldState::takeChangedObjects(std::vector<int>& objects)
+{
+    objects.clear();
+    objects.swap(changedObjects);
+    for (int object : objects) {
+        changed[object] = false;
+    }
+}
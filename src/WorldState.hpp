@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include "KdTree.hpp"
+
+// Cell types that change while playing. The objects of each type are kept in index lists,
+// so a change is applied once, when it happens, instead of by scanning the whole tree.
+// Changed leaves get their kd-tree bounds refitted, and changed objects are collected for
+// render data that is cached across frames.
+class WorldState
+{
+private:
+    KdTree* tree = nullptr;
+    std::vector<int> typeObjects[gridCellTypes];    // kd-tree object indices per cell type
+    std::vector<int> typeSlots;     // position of each object in its type list
+    std::vector<int> leaves;        // kd-tree leaf of each object
+    std::vector<int> changedObjects;
+    std::vector<bool> changed;
+
+public:
+    void init(KdTree& kdTree);
+
+    const std::vector<int>& objects(GridCell type) const { return typeObjects[static_cast<int>(type)]; }
+    size_t count(GridCell type) const { return objects(type).size(); }
+    GridCell type(int object) const { return tree->objects[object].type; }
+    int leaf(int object) const { return leaves[object]; }
+    void setType(int object, GridCell type);
+
+    // hands the objects changed since the last call to the caller
+    void takeChangedObjects(std::vector<int>& objects);
+};
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2016 Computer Graphics Group, University of Siegen
+ * Written by Martin Lambers <martin.lambers@uni-siegen.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#version 430
+
+layout(local_size_x = 64) in;
+
+struct Cell
+{
+    vec2 position;  // grid cell center in the world xz plane
+    uint type;      // GridCell
+    uint pad;
+};
+
+struct DrawCommand
+{
+    uint count;
+    uint instance_count;
+    uint first_index;
+    int base_vertex;
+    uint base_instance;
+};
+
+layout(std430, binding = 2) readonly buffer Cells
+{
+    Cell cells[];
+};
+
+// per mesh range of visible cells, each entry is mesh << 30 | cell index
+layout(std430, binding = 3) writeonly buffer VisibleCells
+{
+    uint visible_cells[];
+};
+
+// wall, floor and coin command; instance counts start at zero
+layout(std430, binding = 4) buffer Commands
+{
+    DrawCommand commands[3];
+};
+
+layout(binding = 0) uniform sampler2D depth_pyramid;   // maximum depth of the previous frame
+
+uniform uint cell_count;
+uniform bool frustum_culling;
+uniform vec4 frustum_planes[6];
+uniform bool occlusion_culling;
+uniform mat4 pyramid_matrix;    // projection * view the depth pyramid was rendered with
+
+const uint EMPTY = 0u;
+const uint WALL = 1u;
+const uint COIN = 4u;
+const uint DOOR = 5u;
+
+const float cell_height = 2.0;  // see KdTree.hpp
+const float coin_height = 1.35;
+const float depth_bias = 1.0 / 65536.0;  // well above the rounding of a 24 bit depth buffer
+
+bool outside_frustum(vec3 box_min, vec3 box_max)
+{
+    for (int i = 0; i < 6; i++) {
+        vec4 plane = frustum_planes[i];
+        vec3 p = mix(box_min, box_max, greaterThan(plane.xyz, vec3(0.0)));
+        if (dot(plane.xyz, p) + plane.w < 0.0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool occluded(vec3 box_min, vec3 box_max)
+{
+    vec3 ndc_min = vec3(1.0);
+    vec3 ndc_max = vec3(-1.0);
+    for (int i = 0; i < 8; i++) {
+        vec3 corner = mix(box_min, box_max, bvec3((i & 1) != 0, (i & 2) != 0, (i & 4) != 0));
+        vec4 clip = pyramid_matrix * vec4(corner, 1.0);
+        if (clip.w <= 0.0) {
+            return false;   // reaches behind the previous camera
+        }
+        vec3 ndc = clip.xyz / clip.w;
+        ndc_min = min(ndc_min, ndc);
+        ndc_max = max(ndc_max, ndc);
+    }
+    if (any(lessThan(ndc_min.xy, vec2(-1.0))) || any(greaterThan(ndc_max.xy, vec2(1.0)))) {
+        return false;   // partly outside the previous view, where there is no depth
+    }
+
+    // choose the finest level at which the box touches at most 3x3 texels
+    ivec2 size = textureSize(depth_pyramid, 0);
+    ivec2 pixel_min = min(ivec2((ndc_min.xy * 0.5 + 0.5) * vec2(size)), size - 1);
+    ivec2 pixel_max = min(ivec2((ndc_max.xy * 0.5 + 0.5) * vec2(size)), size - 1);
+    ivec2 extent = pixel_max - pixel_min + 1;
+    int level = int(ceil(log2(float(max(extent.x, extent.y))))) - 1;
+    level = clamp(level, 0, textureQueryLevels(depth_pyramid) - 1);
+    // computed instead of queried, textureSize with a lod that differs between invocations fails on llvmpipe
+    ivec2 level_size = max(size >> level, ivec2(1));
+    ivec2 texel_min = min(pixel_min >> level, level_size - 1);
+    ivec2 texel_max = min(pixel_max >> level, level_size - 1);
+
+    float max_depth = 0.0;
+    for (int y = texel_min.y; y <= texel_max.y; y++) {
+        for (int x = texel_min.x; x <= texel_max.x; x++) {
+            max_depth = max(max_depth, texelFetch(depth_pyramid, ivec2(x, y), level).r);
+        }
+    }
+    // the rasterized depth of a face is rounded, so a box must lie clearly behind to be hidden
+    return ndc_min.z * 0.5 + 0.5 > max_depth + depth_bias;
+}
+
+void append(uint mesh, uint index)
+{
+    uint slot = atomicAdd(commands[mesh].instance_count, 1u);
+    visible_cells[commands[mesh].base_instance + slot] = (mesh << 30) | index;
+}
+
+void main(void)
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= cell_count) {
+        return;
+    }
+    Cell cell = cells[index];
+
+    // same boxes as objectBounds
+    float height = 0.0;
+    if (cell.type == WALL || cell.type == DOOR) {
+        height = cell_height;
+    } else if (cell.type == COIN) {
+        height = coin_height;
+    }
+    vec3 box_min = vec3(cell.position.x - 1.0, 0.0, cell.position.y - 1.0);
+    vec3 box_max = vec3(cell.position.x + 1.0, height, cell.position.y + 1.0);
+    if (frustum_culling && outside_frustum(box_min, box_max)) {
+        return;
+    }
+    if (occlusion_culling && occluded(box_min, box_max)) {
+        return;
+    }
+
+    if (cell.type == WALL || cell.type == DOOR) {
+        append(0u, index);
+    } else {
+        append(1u, index);
+        if (cell.type == COIN) {
+            append(2u, index);
+        }
+    }
+}
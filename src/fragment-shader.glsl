@@ -23,11 +23,10 @@
 
 #version 330
 
-uniform vec3 color;
-
 in vec3 vnormal;
 in vec3 vview;
 in vec3 vlight;
+in vec3 vcolor;
 
 layout(location = 0) out vec4 fcolor;
 
@@ -48,5 +47,5 @@ void main(void)
 
     float specular = ks * pow(max(dot(h, n), 0.0), shininess);
 
-    fcolor = vec4(color * vec3(ka + diffuse + specular), 1.0);
+    fcolor = vec4(vcolor * vec3(ka + diffuse + specular), 1.0);
 }
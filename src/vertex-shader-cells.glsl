@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 Computer Graphics Group, University of Siegen
+ * Written by Martin Lambers <martin.lambers@uni-siegen.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#version 430
+
+layout(std140, binding = 0) uniform View
+{
+    mat4 projection_matrix;
+    mat4 view_matrix;
+};
+
+struct Cell
+{
+    vec2 position;
+    uint type;
+    uint pad;
+};
+
+layout(std430, binding = 2) readonly buffer Cells
+{
+    Cell cells[];
+};
+
+uniform float time;         // seconds of coin animation
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in uint visible_cell;  // mesh << 30 | cell index, written by compute-shader-cull.glsl
+
+out vec3 vnormal;
+out vec3 vview;
+out vec3 vlight;
+out vec3 vcolor;
+
+const vec4 wlight = vec4(-10.0, -30.0, -20.0, 1.0);
+
+// colors of the GridCell types, see MazeApp::drawObject
+const vec3 cell_colors[6] = vec3[](
+    vec3(0.5, 0.5, 0.5),    // empty
+    vec3(1.0, 0.0, 0.0),    // wall
+    vec3(0.0, 1.0, 0.0),    // finish
+    vec3(0.7, 0.7, 0.0),    // spawn
+    vec3(0.5, 0.5, 0.5),    // coin, the floor below it
+    vec3(0.0, 0.0, 1.0));   // door
+const vec3 coin_color = vec3(1.0, 1.0, 0.0);
+const float coin_speed = 100.0;         // degrees per second, see coinSpeed in MazeApp.hpp
+const float coin_phase_scale = 0.25;    // see coinPhaseScale in MazeApp.hpp
+
+// the spin of vertex-shader-coins.glsl, with the phase that CoinBuffer stores per coin
+mat4 coin_matrix(vec2 position)
+{
+    float angle = radians(coin_speed) * time + coin_phase_scale * (position.x + position.y);
+    float c = cos(angle);
+    float s = sin(angle);
+    const mat3 upright = mat3(1.0, 0.0, 0.0,  0.0, 0.0, 1.0,  0.0, -1.0, 0.0);
+    mat3 spin = mat3(c, s, 0.0,  -s, c, 0.0,  0.0, 0.0, 1.0);
+    return mat4(upright * spin * 2.0);
+}
+
+void main(void)
+{
+    uint mesh = visible_cell >> 30;
+    Cell cell = cells[visible_cell & 0x3fffffffu];
+    mat4 model_matrix = mat4(1.0);
+    model_matrix[3] = vec4(cell.position.x, 1.0, cell.position.y, 1.0);
+    vcolor = cell_colors[cell.type];
+    if (mesh == 2u) {
+        model_matrix = model_matrix * coin_matrix(cell.position);
+        vcolor = coin_color;
+    }
+
+    mat4 modelview_matrix = view_matrix * model_matrix;
+    vec4 position = vec4(pos, 1.0);
+    // model matrices only rotate, translate and scale uniformly
+    vnormal = mat3(modelview_matrix) * normal;
+    vview = -(modelview_matrix * position).xyz;
+    vlight = -(view_matrix * wlight).xyz;
+    gl_Position = projection_matrix * modelview_matrix * position;
+}
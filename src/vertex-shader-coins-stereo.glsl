@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 Computer Graphics Group, University of Siegen
+ * Written by Martin Lambers <martin.lambers@uni-siegen.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#version 430
+
+// both eyes of single-pass stereo, indexed by the layer
+layout(std140, binding = 3) uniform StereoView
+{
+    mat4 projection_matrices[2];
+    mat4 view_matrices[2];
+};
+
+struct Coin
+{
+    vec2 position;      // world x/z of the cell
+    float phase;        // added to the spin angle, in radians
+    float pad;
+};
+
+// the remaining coins, see CoinBuffer
+layout(std430, binding = 5) readonly buffer Coins
+{
+    Coin coins[];
+};
+
+// the coins of the rendered cells, one per instance
+layout(std430, binding = 6) readonly buffer VisibleCoins
+{
+    uint visible_coins[];
+};
+
+uniform float time;     // seconds of coin animation
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 normal;
+
+out vec3 gs_normal;
+out vec3 gs_view;
+out vec3 gs_light;
+out vec3 gs_color;
+flat out int gs_layer;
+
+const vec4 wlight = vec4(-10.0, -30.0, -20.0, 1.0);
+const float coin_speed = 100.0;     // degrees per second, see coinSpeed in MazeApp.hpp
+const vec3 coin_color = vec3(1.0, 1.0, 0.0);
+
+// stands the coin mesh upright, spins it about the vertical axis and scales it to the cell
+mat4 coin_model_matrix(Coin coin)
+{
+    float angle = radians(coin_speed) * time + coin.phase;
+    float c = cos(angle);
+    float s = sin(angle);
+    const mat3 upright = mat3(1.0, 0.0, 0.0,  0.0, 0.0, 1.0,  0.0, -1.0, 0.0);
+    mat3 spin = mat3(c, s, 0.0,  -s, c, 0.0,  0.0, 0.0, 1.0);
+    mat4 model_matrix = mat4(upright * spin * 2.0);
+    model_matrix[3] = vec4(coin.position.x, 1.0, coin.position.y, 1.0);
+    return model_matrix;
+}
+
+void main(void)
+{
+    // every coin is drawn twice, the even instance for the left eye
+    int layer = gl_InstanceID % 2;
+    mat4 view_matrix = view_matrices[layer];
+    mat4 modelview_matrix = view_matrix * coin_model_matrix(coins[visible_coins[gl_InstanceID / 2]]);
+    vec4 position = vec4(pos, 1.0);
+    // model matrices only rotate, translate and scale uniformly
+    gs_normal = mat3(modelview_matrix) * normal;
+    gs_view = -(modelview_matrix * position).xyz;
+    gs_light = -(view_matrix * wlight).xyz;
+    gs_color = coin_color;
+    gs_layer = layer;
+    gl_Position = projection_matrices[layer] * modelview_matrix * position;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Computer Graphics Group, University of Siegen
+ * Written by Martin Lambers <martin.lambers@uni-siegen.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#version 430
+
+layout(std140, binding = 0) uniform View
+{
+    mat4 projection_matrix;
+    mat4 view_matrix;
+};
+
+struct ObjectData
+{
+    mat4 model_matrix;
+    vec4 color;
+};
+
+// objects of the current frame, see ObjectDataBuffer
+layout(std430, binding = 1) readonly buffer Objects
+{
+    ObjectData objects[];
+};
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in uint object_index;  // instance index plus the base instance of the draw
+
+out vec3 vnormal;
+out vec3 vview;
+out vec3 vlight;
+out vec3 vcolor;
+
+const vec4 wlight = vec4(-10.0, -30.0, -20.0, 1.0);
+
+void main(void)
+{
+    ObjectData object = objects[object_index];
+    mat4 modelview_matrix = view_matrix * object.model_matrix;
+    vec4 position = vec4(pos, 1.0);
+    // model matrices only rotate, translate and scale uniformly
+    vnormal = mat3(modelview_matrix) * normal;
+    vview = -(modelview_matrix * position).xyz;
+    vlight = -(view_matrix * wlight).xyz;
+    vcolor = object.color.rgb;
+    gl_Position = projection_matrix * modelview_matrix * position;
+}
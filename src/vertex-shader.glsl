@@ -27,6 +27,7 @@ uniform mat4 projection_matrix;
 uniform mat4 modelview_matrix;
 uniform mat4 view_matrix;
 uniform mat3 normal_matrix;
+uniform vec3 color;
 
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 normal;
@@ -34,6 +35,7 @@ layout(location = 1) in vec3 normal;
 out vec3 vnormal;
 out vec3 vview;
 out vec3 vlight;
+out vec3 vcolor;
 
 const vec4 wlight = vec4(-10.0, -30.0, -20.0, 1.0);
 
@@ -43,5 +45,6 @@ void main(void)
     vnormal = normal_matrix * normal;
     vview = -(modelview_matrix * position).xyz;
     vlight = -(view_matrix * wlight).xyz;
+    vcolor = color;
     gl_Position = projection_matrix * modelview_matrix * position;
 }